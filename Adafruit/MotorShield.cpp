@@ -17,22 +17,170 @@
 #include "MotorShield.hpp"
 #include "meb_print.h"
 #include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <math.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <algorithm>
 #include <thread>
-#include <vector>
-#include <list>
+#include <chrono>
 
 #ifndef _DOXYGEN_
 #define LOW 0
 #define HIGH 1
 
-static std::list<void *> lib_steppers;
-static std::list<void *> lib_dcmotors;
-static std::mutex handler_lock;
+#define PCA9685_PRESCALE_MIN 3 // limited by the chip
 
+// Encode raw LEDn_ON/LEDn_OFF values into the 4-byte register layout of a channel.
+static inline void encodeChannel(uint8_t *regs, uint16_t on, uint16_t off)
+{
+    regs[0] = on;
+    regs[1] = on >> 8;
+    regs[2] = off;
+    regs[3] = off >> 8;
+}
+
+// Register layout equivalent of MotorShield::setPWM(pin, val).
+static inline void encodePWM(uint8_t *regs, uint16_t val)
+{
+    if (val > 4095)
+        encodeChannel(regs, 4096, 0);
+    else
+        encodeChannel(regs, 0, val);
+}
+
+// Register layout equivalent of MotorShield::setPin(pin, val).
+static inline void encodePin(uint8_t *regs, bool val)
+{
+    if (val == LOW)
+        encodeChannel(regs, 0, 0);
+    else
+        encodeChannel(regs, 4096, 0);
+}
+
+static inline uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+
+static void statsRecord(Adafruit::StatsHistogram &h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= ADAFRUIT_STATS_BUCKETS)
+        bucket = ADAFRUIT_STATS_BUCKETS - 1;
+    h.count[bucket].fetch_add(1, std::memory_order_relaxed);
+    h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint32_t clipped = ns > UINT32_MAX ? UINT32_MAX : ns;
+    if (clipped > h.max_ns.load(std::memory_order_relaxed))
+        h.max_ns.store(clipped, std::memory_order_relaxed); // single writer per histogram
+}
+
+static void statsRead(const Adafruit::StatsHistogram &h, Adafruit::LatencyHistogram &out)
+{
+    for (int i = 0; i < ADAFRUIT_STATS_BUCKETS; i++)
+        out.count[i] = h.count[i].load(std::memory_order_relaxed);
+    out.total_ns = h.total_ns.load(std::memory_order_relaxed);
+    out.max_ns = h.max_ns.load(std::memory_order_relaxed);
+}
+
+static void statsClear(Adafruit::StatsHistogram &h)
+{
+    for (int i = 0; i < ADAFRUIT_STATS_BUCKETS; i++)
+        h.count[i] = 0;
+    h.total_ns = 0;
+    h.max_ns = 0;
+}
+#endif
+
+static std::atomic<Adafruit::MotorShield *> lib_shields[ADAFRUIT_MAX_SHIELDS]; // initialized shields, stopped on a signal
+static std::mutex estop_lock;                 // held by the stop thread while it uses the shields in lib_shields
+static std::mutex estop_start_lock;           // creation of the stop thread
+static std::atomic<int> estop_fd(-1);         // eventfd of the stop thread, -1 until the first shield is initialized
+static std::atomic<uint32_t> estop_epoch(0);  // emergency stops requested
+static std::atomic<uint32_t> estop_done(0);   // emergency stops completed by the stop thread
+static std::atomic<uint32_t> estop_halts(0);  // emergency stops that stopped the steppers and are turning the outputs off
+
+static int defaultOpen(i2cbus *dev, int id, int addr)
+{
+    return i2cbus_open(dev, id, addr);
+}
+
+static int defaultWrite(i2cbus *dev, const void *buf, ssize_t len)
+{
+    return i2cbus_write(dev, buf, len);
+}
+
+static int defaultXfer(i2cbus *dev, void *out, ssize_t outlen, void *in, ssize_t inlen, unsigned long timeout_usec)
+{
+    return i2cbus_xfer(dev, out, outlen, in, inlen, timeout_usec);
+}
+
+static int defaultClose(i2cbus *dev)
+{
+    return i2cbus_close(dev);
+}
+
+static bool setThreadRealtime(std::thread &thread, int priority, int cpu, const char *name)
+{
+    struct sched_param param;
+    memset(&param, 0x0, sizeof(param));
+    int policy = SCHED_OTHER;
+    if (priority > 0)
+    {
+        if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO))
+        {
+            bprintlf("SCHED_FIFO priority %d out of range (%d-%d)", priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+            return false;
+        }
+        policy = SCHED_FIFO;
+        param.sched_priority = priority;
+    }
+    int ret = pthread_setschedparam(thread.native_handle(), policy, &param);
+    if (ret == EPERM)
+    {
+        bprintlf("Not permitted to run the %s thread under SCHED_FIFO, requires CAP_SYS_NICE or RLIMIT_RTPRIO >= %d", name, priority);
+        return false;
+    }
+    else if (ret)
+    {
+        bprintlf("Error %d setting scheduling policy of the %s thread: %s", ret, name, strerror(ret));
+        return false;
+    }
+    if (cpu >= 0)
+    {
+        if (cpu >= CPU_SETSIZE)
+        {
+            bprintlf("CPU %d out of range", cpu);
+            return false;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        ret = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+        if (ret)
+        {
+            bprintlf("Error %d pinning the %s thread to CPU %d: %s", ret, name, cpu, strerror(ret));
+            return false;
+        }
+    }
+    return true;
+}
+
+static thread_local bool stepping_thread = false; // I2C transactions are limited by RetryPolicy::step_budget_us
+
+static const Adafruit::I2CBackend default_backend = {defaultOpen, defaultWrite, defaultXfer, defaultClose};
+static std::atomic<const Adafruit::I2CBackend *> i2c_backend(&default_backend);
 
 static void (*old_handler_sigint)(int) = nullptr;
 static void (*old_handler_sighup)(int) = nullptr;
@@ -46,169 +194,243 @@ namespace Adafruit
 {
     void MotorShield::sighandler(int sig)
     {
-        std::lock_guard<std::mutex> lock(handler_lock);
-        for (void *_stepper : lib_steppers)
-        {
-            Adafruit::StepperMotor *stepper = (Adafruit::StepperMotor *)_stepper;
-            stepper->stopMotor();
-        }
-
-        for (void *_dcmot : lib_dcmotors)
-        {
-            Adafruit::DCMotor *motor = (Adafruit::DCMotor *)_dcmot;
-            motor->fullOff();
-        }
+        emergencyStop();
 
-        if (old_handler_sigint != nullptr)
+        // SIG_DFL and SIG_IGN are not functions
+        if (old_handler_sigint != nullptr && old_handler_sigint != SIG_IGN)
             old_handler_sigint(sig);
-        if (old_handler_sighup != nullptr)
+        if (old_handler_sighup != nullptr && old_handler_sighup != SIG_IGN)
             old_handler_sighup(sig);
 #ifdef SIGPIPE
-        if (old_handler_sigpipe != nullptr)
+        if (old_handler_sigpipe != nullptr && old_handler_sigpipe != SIG_IGN)
             old_handler_sigpipe(sig);
 #endif
     }
 
-    /**
-     * @brief Sinusoidal microstepping curve (sine curve between 0 and pi/2)
-     * for the PWM output (12-bit range), with n + 1 points (in this case, n = 8).
-     * The last point is the beginning of the next step.
-     *
-     */
-    static uint16_t microstepcurve8[] = {0, 798, 1567, 2275, 2895,
-                                         3404, 3783, 4016, 4095};
+    void MotorShield::emergencyStop()
+    {
+        // Only atomics, write() and nanosleep() here, this runs in signal handlers. The stop thread does the I2C.
+        int fd = estop_fd.load();
+        if (fd < 0)
+            return; // no shield initialized yet
+        int err = errno;
+        uint32_t epoch = estop_epoch.fetch_add(1) + 1;
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) == sizeof(one))
+        {
+            // The wait is bounded: if this thread holds the bus, the stop thread can only finish once this returns.
+            struct timespec ts = {0, 100000};
+            for (int i = 0; i < ADAFRUIT_ESTOP_WAIT_MS * 10 && (int32_t)(estop_done.load() - epoch) < 0; i++)
+                nanosleep(&ts, NULL);
+        }
+        errno = err;
+    }
 
-    /**
-     * @brief Microstep curve for n = 16.
-     *
-     */
-    static uint16_t microstepcurve16[] = {0, 401, 798, 1188, 1567, 1930, 2275, 2597, 2895, 3165, 3404,
-                                          3611, 3783, 3918, 4016, 4075, 4095};
+    void MotorShield::estopFn(int fd)
+    {
+        while (true)
+        {
+            uint64_t count;
+            ssize_t ret = read(fd, &count, sizeof(count));
+            if (ret < 0 && errno == EINTR)
+                continue;
+            else if (ret != sizeof(count))
+            {
+                bprintlf("Error %d waiting for emergency stops, signals no longer stop the motors: %s", errno, strerror(errno));
+                return;
+            }
+            uint32_t epoch = estop_epoch.load();
+            {
+                std::lock_guard<std::mutex> lock(estop_lock);
+                for (int i = 0; i < ADAFRUIT_MAX_SHIELDS; i++)
+                {
+                    MotorShield *shield = lib_shields[i].load();
+                    if (shield == nullptr)
+                        continue;
+                    shield->steppers[0].stopMotor();
+                    shield->steppers[1].stopMotor();
+                }
+                // a move stopped above takes no further step, not even to an integral microstep, see stepHandlerFn()
+                estop_halts.fetch_add(1);
+                // one transaction per shield turns off every DC motor and stepper coil
+                for (int i = 0; i < ADAFRUIT_MAX_SHIELDS; i++)
+                {
+                    MotorShield *shield = lib_shields[i].load();
+                    if (shield != nullptr)
+                        shield->allOff();
+                }
+            }
+            estop_done.store(epoch);
+        }
+    }
 
-    /**
-     * @brief Microstep curve for n = 32.
-     *
-     */
-    static uint16_t microstepcurve32[] = {0, 200, 401, 600, 798, 995, 1188, 1379, 1567, 1750, 1930,
-                                          2105, 2275, 2439, 2597, 2750, 2895, 3034, 3165, 3289, 3404, 3512,
-                                          3611, 3701, 3783, 3855, 3918, 3972, 4016, 4050, 4075, 4090, 4095};
+    bool MotorShield::registerShield()
+    {
+        {
+            std::lock_guard<std::mutex> lock(estop_start_lock);
+            if (estop_fd.load() < 0)
+            {
+                int fd = eventfd(0, EFD_CLOEXEC);
+                if (fd < 0)
+                {
+                    bprintlf("Error %d creating emergency stop eventfd: %s", errno, strerror(errno));
+                    return false;
+                }
+                // the handler must not run on the stop thread, it would wait for itself
+                sigset_t all, old;
+                sigfillset(&all);
+                pthread_sigmask(SIG_BLOCK, &all, &old);
+                std::thread(estopFn, fd).detach();
+                pthread_sigmask(SIG_SETMASK, &old, NULL);
+                estop_fd = fd;
+            }
+        }
+        for (int i = 0; i < ADAFRUIT_MAX_SHIELDS; i++)
+        {
+            MotorShield *expected = nullptr;
+            if (lib_shields[i].compare_exchange_strong(expected, this))
+                return true;
+        }
+        bprintlf("More than %d motor shields initialized, shield 0x%02x on bus %d is not stopped on a signal", ADAFRUIT_MAX_SHIELDS, _addr, _bus);
+        return false;
+    }
+
+    void MotorShield::unregisterShield()
+    {
+        for (int i = 0; i < ADAFRUIT_MAX_SHIELDS; i++)
+        {
+            MotorShield *expected = this;
+            if (lib_shields[i].compare_exchange_strong(expected, nullptr))
+                break;
+        }
+        std::lock_guard<std::mutex> lock(estop_lock); // a stop in progress may still use this shield
+    }
+
+#ifndef _DOXYGEN_
+    template <unsigned... I>
+    struct IndexList
+    {
+    };
+
+    template <unsigned N, unsigned... I>
+    struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...>
+    {
+    };
+
+    template <unsigned... I>
+    struct MakeIndexList<0, I...>
+    {
+        typedef IndexList<I...> type;
+    };
+
+    // Taylor series of sin(x) from the term x^n / n!, converges to double precision for 0 <= x <= pi/2
+    static constexpr double sinSeries(double x2, double term, unsigned n)
+    {
+        return n > 27 ? term : term + sinSeries(x2, -term * x2 / ((n + 1) * (n + 2)), n + 2);
+    }
+
+    static constexpr double sinQuadrant(double x)
+    {
+        return sinSeries(x * x, x, 1);
+    }
+#endif // _DOXYGEN_
 
     /**
-     * @brief Microstep curve for n = 64.
+     * @brief Point i of the sinusoidal microstepping curve for n microsteps, floor(4095 * sin(i * pi / 2n)).
+     * The last point (i = n) is the beginning of the next step.
      *
      */
-    static uint16_t microstepcurve64[] = {0, 100, 200, 301, 401, 501, 600, 700, 798, 897, 995,
-                                          1092, 1188, 1284, 1379, 1473, 1567, 1659, 1750, 1841, 1930, 2018,
-                                          2105, 2190, 2275, 2357, 2439, 2519, 2597, 2674, 2750, 2823, 2895,
-                                          2965, 3034, 3100, 3165, 3228, 3289, 3348, 3404, 3459, 3512, 3563,
-                                          3611, 3657, 3701, 3743, 3783, 3820, 3855, 3888, 3918, 3946, 3972,
-                                          3995, 4016, 4034, 4050, 4064, 4075, 4083, 4090, 4093, 4095};
+    static constexpr uint16_t microstepPoint(unsigned i, unsigned n)
+    {
+        return i >= n ? 4095 : (uint16_t)(4095 * sinQuadrant(i * M_PI / (2 * n)));
+    }
 
     /**
-     * @brief Microstep curve for n = 128.
+     * @brief Sinusoidal microstepping curve (sine curve between 0 and pi/2) for the PWM output (12-bit range),
+     * with N + 1 points, generated at compile time.
      *
      */
-    static uint16_t microstepcurve128[] = {0, 50, 100, 150, 200, 251, 301, 351, 401, 451, 501,
-                                           551, 600, 650, 700, 749, 798, 848, 897, 946, 995, 1043,
-                                           1092, 1140, 1188, 1236, 1284, 1332, 1379, 1426, 1473, 1520, 1567,
-                                           1613, 1659, 1705, 1750, 1796, 1841, 1885, 1930, 1974, 2018, 2061,
-                                           2105, 2148, 2190, 2233, 2275, 2316, 2357, 2398, 2439, 2479, 2519,
-                                           2558, 2597, 2636, 2674, 2712, 2750, 2787, 2823, 2859, 2895, 2930,
-                                           2965, 3000, 3034, 3067, 3100, 3133, 3165, 3197, 3228, 3258, 3289,
-                                           3318, 3348, 3376, 3404, 3432, 3459, 3486, 3512, 3537, 3563, 3587,
-                                           3611, 3634, 3657, 3680, 3701, 3723, 3743, 3763, 3783, 3802, 3820,
-                                           3838, 3855, 3872, 3888, 3903, 3918, 3932, 3946, 3959, 3972, 3984,
-                                           3995, 4006, 4016, 4025, 4034, 4042, 4050, 4057, 4064, 4070, 4075,
-                                           4079, 4083, 4087, 4090, 4092, 4093, 4094, 4095};
+    template <unsigned N, typename = typename MakeIndexList<N + 1>::type>
+    struct MicrostepCurve;
+
+#ifndef _DOXYGEN_
+    template <unsigned N, unsigned... I>
+    struct MicrostepCurve<N, IndexList<I...>>
+    {
+        static constexpr uint16_t value[N + 1] = {microstepPoint(I, N)...};
+    };
+
+    template <unsigned N, unsigned... I>
+    constexpr uint16_t MicrostepCurve<N, IndexList<I...>>::value[N + 1];
+#endif // _DOXYGEN_
+
+#ifndef _DOXYGEN_
+    static void fillStepEntry(StepperMotorStepEntry *entry, uint16_t ocra, uint16_t ocrb, uint8_t latch_state)
+    {
+        entry->pwma = ocra;
+        entry->pwmb = ocrb;
+        entry->latch = latch_state;
+        // channel order of a stepper port: PWMA, AIN2, AIN1, BIN1, BIN2, PWMB
+        encodePWM(&entry->regs[4 * 0], ocra);
+        encodePin(&entry->regs[4 * 1], latch_state & 0x1);
+        encodePin(&entry->regs[4 * 2], latch_state & 0x4);
+        encodePin(&entry->regs[4 * 3], latch_state & 0x2);
+        encodePin(&entry->regs[4 * 4], latch_state & 0x8);
+        encodePWM(&entry->regs[4 * 5], ocrb);
+    }
+
+    static bool buildFullstepTable(StepperMotorStepEntry *table)
+    {
+        static const uint8_t latches[8] = {0x1, 0x3, 0x2, 0x6, 0x4, 0xC, 0x8, 0x9};
+        for (int i = 0; i < 8; i++)
+            fillStepEntry(&table[i], 4095, 4095, latches[i]);
+        return true;
+    }
 
     /**
-     * @brief Microstep curve for n = 256.
+     * @brief Coil energization for each half step (SINGLE, DOUBLE and INTERLEAVE), both PWM outputs at 4095.
+     * Indexed by currentstep / (microsteps / 2).
      *
      */
-    static uint16_t microstepcurve256[] = {
-        0, 25, 50, 75, 100, 125, 150, 175, 200, 226, 251,
-        276, 301, 326, 351, 376, 401, 426, 451, 476, 501, 526,
-        551, 575, 600, 625, 650, 675, 700, 724, 749, 774, 798,
-        823, 848, 872, 897, 921, 946, 970, 995, 1019, 1043, 1067,
-        1092, 1116, 1140, 1164, 1188, 1212, 1236, 1260, 1284, 1308, 1332,
-        1355, 1379, 1403, 1426, 1450, 1473, 1497, 1520, 1543, 1567, 1590,
-        1613, 1636, 1659, 1682, 1705, 1728, 1750, 1773, 1796, 1818, 1841,
-        1863, 1885, 1908, 1930, 1952, 1974, 1996, 2018, 2040, 2061, 2083,
-        2105, 2126, 2148, 2169, 2190, 2212, 2233, 2254, 2275, 2295, 2316,
-        2337, 2357, 2378, 2398, 2419, 2439, 2459, 2479, 2499, 2519, 2539,
-        2558, 2578, 2597, 2617, 2636, 2655, 2674, 2693, 2712, 2731, 2750,
-        2768, 2787, 2805, 2823, 2841, 2859, 2877, 2895, 2913, 2930, 2948,
-        2965, 2983, 3000, 3017, 3034, 3051, 3067, 3084, 3100, 3117, 3133,
-        3149, 3165, 3181, 3197, 3212, 3228, 3243, 3258, 3274, 3289, 3304,
-        3318, 3333, 3348, 3362, 3376, 3390, 3404, 3418, 3432, 3446, 3459,
-        3473, 3486, 3499, 3512, 3525, 3537, 3550, 3563, 3575, 3587, 3599,
-        3611, 3623, 3634, 3646, 3657, 3668, 3680, 3691, 3701, 3712, 3723,
-        3733, 3743, 3753, 3763, 3773, 3783, 3792, 3802, 3811, 3820, 3829,
-        3838, 3847, 3855, 3864, 3872, 3880, 3888, 3896, 3903, 3911, 3918,
-        3925, 3932, 3939, 3946, 3953, 3959, 3966, 3972, 3978, 3984, 3989,
-        3995, 4000, 4006, 4011, 4016, 4021, 4025, 4030, 4034, 4038, 4042,
-        4046, 4050, 4054, 4057, 4061, 4064, 4067, 4070, 4072, 4075, 4077,
-        4079, 4081, 4083, 4085, 4087, 4088, 4090, 4091, 4092, 4093, 4093,
-        4094, 4094, 4094, 4095};
+    static StepperMotorStepEntry fullsteptable[8];
+    static bool fullsteptable_built = buildFullstepTable(fullsteptable);
 
     /**
-     * @brief Microstep curve for n = 512.
+     * @brief Half steps advanced by SINGLE, DOUBLE and INTERLEAVE stepping, given the parity of the current half step.
+     * SINGLE moves to the next even half step, DOUBLE to the next odd half step. Any other style does not move.
      *
      */
-    static uint16_t microstepcurve512[] = {
-        0, 12, 25, 37, 50, 62, 75, 87, 100, 113, 125,
-        138, 150, 163, 175, 188, 200, 213, 226, 238, 251, 263,
-        276, 288, 301, 313, 326, 338, 351, 363, 376, 388, 401,
-        413, 426, 438, 451, 463, 476, 488, 501, 513, 526, 538,
-        551, 563, 575, 588, 600, 613, 625, 638, 650, 662, 675,
-        687, 700, 712, 724, 737, 749, 761, 774, 786, 798, 811,
-        823, 835, 848, 860, 872, 884, 897, 909, 921, 933, 946,
-        958, 970, 982, 995, 1007, 1019, 1031, 1043, 1055, 1067, 1080,
-        1092, 1104, 1116, 1128, 1140, 1152, 1164, 1176, 1188, 1200, 1212,
-        1224, 1236, 1248, 1260, 1272, 1284, 1296, 1308, 1320, 1332, 1344,
-        1355, 1367, 1379, 1391, 1403, 1414, 1426, 1438, 1450, 1462, 1473,
-        1485, 1497, 1508, 1520, 1532, 1543, 1555, 1567, 1578, 1590, 1601,
-        1613, 1624, 1636, 1647, 1659, 1670, 1682, 1693, 1705, 1716, 1728,
-        1739, 1750, 1762, 1773, 1784, 1796, 1807, 1818, 1829, 1841, 1852,
-        1863, 1874, 1885, 1897, 1908, 1919, 1930, 1941, 1952, 1963, 1974,
-        1985, 1996, 2007, 2018, 2029, 2040, 2051, 2061, 2072, 2083, 2094,
-        2105, 2116, 2126, 2137, 2148, 2158, 2169, 2180, 2190, 2201, 2212,
-        2222, 2233, 2243, 2254, 2264, 2275, 2285, 2295, 2306, 2316, 2327,
-        2337, 2347, 2357, 2368, 2378, 2388, 2398, 2409, 2419, 2429, 2439,
-        2449, 2459, 2469, 2479, 2489, 2499, 2509, 2519, 2529, 2539, 2548,
-        2558, 2568, 2578, 2588, 2597, 2607, 2617, 2626, 2636, 2646, 2655,
-        2665, 2674, 2684, 2693, 2703, 2712, 2721, 2731, 2740, 2750, 2759,
-        2768, 2777, 2787, 2796, 2805, 2814, 2823, 2832, 2841, 2850, 2859,
-        2868, 2877, 2886, 2895, 2904, 2913, 2922, 2930, 2939, 2948, 2957,
-        2965, 2974, 2983, 2991, 3000, 3008, 3017, 3025, 3034, 3042, 3051,
-        3059, 3067, 3076, 3084, 3092, 3100, 3108, 3117, 3125, 3133, 3141,
-        3149, 3157, 3165, 3173, 3181, 3189, 3197, 3204, 3212, 3220, 3228,
-        3235, 3243, 3251, 3258, 3266, 3274, 3281, 3289, 3296, 3304, 3311,
-        3318, 3326, 3333, 3340, 3348, 3355, 3362, 3369, 3376, 3383, 3390,
-        3397, 3404, 3411, 3418, 3425, 3432, 3439, 3446, 3452, 3459, 3466,
-        3473, 3479, 3486, 3492, 3499, 3505, 3512, 3518, 3525, 3531, 3537,
-        3544, 3550, 3556, 3563, 3569, 3575, 3581, 3587, 3593, 3599, 3605,
-        3611, 3617, 3623, 3629, 3634, 3640, 3646, 3652, 3657, 3663, 3668,
-        3674, 3680, 3685, 3691, 3696, 3701, 3707, 3712, 3717, 3723, 3728,
-        3733, 3738, 3743, 3748, 3753, 3758, 3763, 3768, 3773, 3778, 3783,
-        3788, 3792, 3797, 3802, 3806, 3811, 3816, 3820, 3825, 3829, 3834,
-        3838, 3842, 3847, 3851, 3855, 3859, 3864, 3868, 3872, 3876, 3880,
-        3884, 3888, 3892, 3896, 3899, 3903, 3907, 3911, 3915, 3918, 3922,
-        3925, 3929, 3932, 3936, 3939, 3943, 3946, 3949, 3953, 3956, 3959,
-        3962, 3966, 3969, 3972, 3975, 3978, 3981, 3984, 3987, 3989, 3992,
-        3995, 3998, 4000, 4003, 4006, 4008, 4011, 4013, 4016, 4018, 4021,
-        4023, 4025, 4028, 4030, 4032, 4034, 4036, 4038, 4040, 4042, 4044,
-        4046, 4048, 4050, 4052, 4054, 4056, 4057, 4059, 4061, 4062, 4064,
-        4065, 4067, 4068, 4070, 4071, 4072, 4074, 4075, 4076, 4077, 4078,
-        4079, 4080, 4081, 4082, 4083, 4084, 4085, 4086, 4087, 4088, 4088,
-        4089, 4090, 4090, 4091, 4091, 4092, 4092, 4093, 4093, 4093, 4094,
-        4094, 4094, 4094, 4094, 4094, 4094, 4095};
+    static constexpr uint8_t halfstepIncrement(MotorStyle style, uint8_t odd)
+    {
+        return style == SINGLE ? 2 - odd : style == DOUBLE ? 1 + odd : style == INTERLEAVE ? 1 : 0;
+    }
+
+#endif // _DOXYGEN_
 
     MotorShield::MotorShield(uint8_t addr, int bus, bool register_sighandler)
     {
         _addr = addr;
         _bus = bus;
+        i2c = i2c_backend;
+        rt_priority = 0;
+        rt_cpu = -1;
+        failing = false;
+        _freq = 0;
+        osc_hz = ADAFRUIT_PCA9685_OSC_HZ;
+        extclk = false;
+        prescale = 0;
+        rampfd = -1;
+        ramp_quit = false;
+        ramps_active = 0;
         initd = false;
+        shadow_valid = 0;
+        memset(shadow, 0x0, sizeof(shadow));
+        async_pos = 0;
+        memset(pending, 0x0, sizeof(pending));
+        pending_mask = 0;
+        pending_listed = false;
+        pending_next = nullptr;
+        resetStats();
         if (register_sighandler)
         {
             struct sigaction sa, sa_old;
@@ -219,12 +441,13 @@ namespace Adafruit
             {
                 throw std::runtime_error("Error " + std::to_string(errno) + " getting old signal handler: " + std::string(strerror(errno)));
             }
-            old_handler_sigint = sa_old.sa_handler;
+            if (sa_old.sa_handler != sighandler) // another shield already registered the handler
+                old_handler_sigint = sa_old.sa_handler;
             sa.sa_handler = sighandler;
             ret = sigaction(SIGINT, &sa, NULL);
             if (ret)
             {
-                throw std::runtime_error("Error " + std::to_string(errno) + " getting old signal handler: " + std::string(strerror(errno)));
+                throw std::runtime_error("Error " + std::to_string(errno) + " setting signal handler: " + std::string(strerror(errno)));
             }
 
 #ifdef ADAFRUIT_ENABLE_SIGHUP
@@ -235,12 +458,13 @@ namespace Adafruit
             {
                 throw std::runtime_error("Error " + std::to_string(errno) + " getting old signal handler: " + std::string(strerror(errno)));
             }
-            old_handler_sighup = sa_old.sa_handler;
+            if (sa_old.sa_handler != sighandler)
+                old_handler_sighup = sa_old.sa_handler;
             sa.sa_handler = sighandler;
-            ret = sigaction(SIGINT, &sa, NULL);
+            ret = sigaction(SIGHUP, &sa, NULL);
             if (ret)
             {
-                throw std::runtime_error("Error " + std::to_string(errno) + " getting old signal handler: " + std::string(strerror(errno)));
+                throw std::runtime_error("Error " + std::to_string(errno) + " setting signal handler: " + std::string(strerror(errno)));
             }
 #endif
 
@@ -253,72 +477,210 @@ namespace Adafruit
             {
                 throw std::runtime_error("Error " + std::to_string(errno) + " getting old signal handler: " + std::string(strerror(errno)));
             }
-            old_handler_sigpipe = sa_old.sa_handler;
+            if (sa_old.sa_handler != sighandler)
+                old_handler_sigpipe = sa_old.sa_handler;
             sa.sa_handler = sighandler;
             ret = sigaction(SIGPIPE, &sa, NULL);
             if (ret)
             {
-                throw std::runtime_error("Error " + std::to_string(errno) + " getting old signal handler: " + std::string(strerror(errno)));
+                throw std::runtime_error("Error " + std::to_string(errno) + " setting signal handler: " + std::string(strerror(errno)));
             }
 #endif
 #endif
         }
+        busmgr = MotorShieldBus::get(bus);
+        if (busmgr == nullptr)
+            throw std::runtime_error("Too many I2C buses in use, could not use bus " + std::to_string(bus));
     }
 
     MotorShield::~MotorShield()
     {
-        std::lock_guard<std::mutex> lock(handler_lock);
-        for (int i = 0; i < 4; i++)
-        {
-            // remove motor from list of vectors for signal handler
-            for (std::list<void *>::iterator it = lib_dcmotors.begin(); it != lib_dcmotors.end(); it++)
-            {
-                if ((*it) == (void *)&dcmotors[i])
-                {
-                    lib_dcmotors.erase(it);
-                    break;
-                }
-            }
-            if (dcmotors[i].initd)
-            {
-                dcmotors[i].fullOff();
-            }
-        }
+        unregisterShield();
         for (int i = 0; i < 2; i++)
         {
-            for (std::list<void *>::iterator it = lib_steppers.begin(); it != lib_steppers.end(); it++)
-            {
-                if ((*it) == (void *)&steppers[i])
-                {
-                    lib_steppers.erase(it);
-                    break;
-                }
-            }
             if (steppers[i].initd)
-            {
-                steppers[i].release();
-            }
+                steppers[i].stopWorker();
         }
-        i2cbus_close(bus);
+        stopRamper();
+        if (initd)
+            allOff(); // releases all motors at once, after pending DC motor commands
+        i2c->close(bus);
+        MotorShieldBus::put(busmgr);
     }
 
-    bool _Catchable MotorShield::begin(uint16_t freq)
+    bool _Catchable MotorShield::begin(uint16_t freq, bool warm_start)
     {
-        if (i2cbus_open(bus, _bus, _addr) < 0)
+        if (i2c->open(bus, _bus, _addr) < 0)
         {
             dbprintlf("Error opening I2C bus %d", _bus);
             throw std::runtime_error("Could not open device " + std::to_string(_addr) + " on bus " + std::to_string(_bus));
         }
         bool status = true;
-        status &= reset();
-        _freq = freq;
-        status &= setPWMFreq(_freq); // This is the maximum PWM frequency
-        for (uint8_t i = 0; i < 16; i++)
-            status &= setPWM(i, 0, 0);
+        shadow_valid = 0; // chip state unknown until every channel is written below
+        if (!warm_start || freq == 0 || !warmStart(freq))
+        {
+            status &= reset();
+            prescale = 0;
+            status &= setFrequency(freq);
+            uint8_t regs[4];
+            encodePWM(regs, 0);
+            status &= writeAll(regs);
+        }
+        if (status && !initd)
+            registerShield();
         initd = status;
         return status;
     }
 
+    bool MotorShield::setFrequency(uint16_t freq)
+    {
+        if (freq == 0)
+        {
+            dbprintlf("PWM frequency has to be positive.");
+            return false;
+        }
+        bool clamped;
+        uint8_t val = calcPrescale(freq, clamped);
+        if (clamped)
+            bprintlf("PWM frequency %u Hz out of range, using %.1f Hz", freq, (double)osc_hz / (4096.0 * (val + 1)));
+        _freq = freq;
+        return configure(val, extclk);
+    }
+
+    uint8_t MotorShield::calcPrescale(uint16_t freq, bool &clamped) const
+    {
+        // prescale = round(osc / (4096 * freq)) - 1
+        uint64_t div = 4096 * (uint64_t)freq;
+        uint64_t val = (osc_hz + div / 2) / div;
+        val = val > 0 ? val - 1 : 0;
+        clamped = val < PCA9685_PRESCALE_MIN || val > 255;
+        if (clamped)
+            val = val < PCA9685_PRESCALE_MIN ? PCA9685_PRESCALE_MIN : 255;
+        return val;
+    }
+
+    void MotorShield::setOscillatorFrequency(uint32_t hz)
+    {
+        osc_hz = hz;
+    }
+
+    bool MotorShield::setExternalClock(uint32_t hz)
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
+        }
+        if (hz == 0 || hz > 50000000)
+        {
+            dbprintlf("External clock frequency %u Hz out of range.", hz);
+            return false;
+        }
+        uint32_t old_hz = osc_hz;
+        bool old_extclk = extclk;
+        osc_hz = hz;
+        extclk = true; // once set, only a power cycle clears EXTCLK
+        if (!setFrequency(_freq))
+        {
+            osc_hz = old_hz;
+            extclk = old_extclk;
+            return false;
+        }
+        return true;
+    }
+
+    uint8_t MotorShield::getPrescale() const
+    {
+        return prescale;
+    }
+
+    double MotorShield::getFrequency() const
+    {
+        if (prescale == 0)
+            return 0;
+        return (double)osc_hz / (4096.0 * (prescale + 1));
+    }
+
+    bool MotorShield::setRealtime(int priority, int cpu, bool lock_memory)
+    {
+        bool status = true;
+        rt_priority = priority;
+        rt_cpu = cpu;
+        if (priority > 0 && lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+        {
+            bprintlf("Error %d locking memory (requires CAP_IPC_LOCK or a sufficient RLIMIT_MEMLOCK): %s", errno, strerror(errno));
+            status = false;
+        }
+        status &= busmgr->setRealtime(priority, cpu);
+        for (int i = 0; i < 2; i++)
+            if (steppers[i].initd)
+                status &= steppers[i].setRealtime(priority, cpu);
+        return status;
+    }
+
+    void MotorShield::setI2CBackend(const I2CBackend *backend)
+    {
+        i2c_backend = backend != nullptr ? backend : &default_backend;
+    }
+
+    uint8_t MotorShield::getAddress() const
+    {
+        return _addr;
+    }
+
+    bool MotorShield::getStats(MotorShieldStats &stats) const
+    {
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        statsRead(stat_latency, stats.latency);
+        stats.transactions = stat_transactions.load(std::memory_order_relaxed);
+        stats.retries = stat_retries.load(std::memory_order_relaxed);
+        stats.failures = stat_failures.load(std::memory_order_relaxed);
+        return true;
+#else
+        memset(&stats, 0x0, sizeof(stats));
+        return false;
+#endif
+    }
+
+    bool MotorShield::setRetryPolicy(const RetryPolicy &policy)
+    {
+        if (policy.max_attempts == 0 || policy.nak_attempts == 0)
+        {
+            dbprintlf("A transaction needs at least one attempt.");
+            return false;
+        }
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        retry = policy;
+        return true;
+    }
+
+    RetryPolicy MotorShield::getRetryPolicy()
+    {
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        return retry;
+    }
+
+    void MotorShield::getErrorCounts(I2CErrorCounts &counts) const
+    {
+        counts.busy = err_busy.load(std::memory_order_relaxed);
+        counts.timeouts = err_timeouts.load(std::memory_order_relaxed);
+        counts.naks = err_naks.load(std::memory_order_relaxed);
+        counts.other = err_other.load(std::memory_order_relaxed);
+        counts.retries = err_retries.load(std::memory_order_relaxed);
+        counts.failures = err_failures.load(std::memory_order_relaxed);
+        counts.budget_exceeded = err_budget.load(std::memory_order_relaxed);
+    }
+
+    void MotorShield::resetStats()
+    {
+        err_busy = err_timeouts = err_naks = err_other = 0;
+        err_retries = err_failures = err_budget = 0;
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        statsClear(stat_latency);
+        stat_transactions = stat_retries = stat_failures = 0;
+#endif
+    }
+
     bool MotorShield::setPWM(uint8_t pin, uint16_t value)
     {
         if (!initd)
@@ -403,9 +765,11 @@ namespace Adafruit
             dcmotors[num].PWMpin = pwm;
             dcmotors[num].IN1pin = in1;
             dcmotors[num].IN2pin = in2;
+            // start the ramp thread here, so ramping a motor never allocates
+            std::lock_guard<std::mutex> lock(ramp_lock);
+            if (!ramper.joinable())
+                startRamper();
         }
-        std::lock_guard<std::mutex> lock(handler_lock);
-        lib_dcmotors.push_back(&dcmotors[num]);
         return &dcmotors[num];
     }
 
@@ -434,10 +798,9 @@ namespace Adafruit
             switch (microsteps)
             {
 #ifndef _DOXYGEN_
-#define MCASE(x)                                           \
-    case (STEP##x):                                        \
-        steppers[port].microsteps = STEP##x;               \
-        steppers[port].microstepcurve = microstepcurve##x; \
+#define MCASE(x)                             \
+    case (STEP##x):                          \
+        steppers[port].microsteps = STEP##x; \
         break;
 #endif // _DOXYGEN_
 
@@ -453,7 +816,6 @@ namespace Adafruit
             default:
                 dbprintlf("Microsteps %u not valid, setting microsteps to %u", (uint8_t)microsteps, (uint8_t)STEP16);
                 steppers[port].microsteps = STEP16;
-                steppers[port].microstepcurve = microstepcurve16;
                 break;
             }
             uint8_t pwma = 8, pwmb = 13, ain1 = 9, ain2 = 10, bin1 = 11, bin2 = 12;
@@ -481,12 +843,50 @@ namespace Adafruit
             steppers[port].AIN2pin = ain2;
             steppers[port].BIN1pin = bin1;
             steppers[port].BIN2pin = bin2;
+            if (!steppers[port].startWorker())
+            {
+                bprintlf("Could not start stepping worker for stepper %u", port + 1);
+                steppers[port].initd = false;
+                return NULL;
+            }
+            if ((rt_priority > 0 || rt_cpu >= 0) && !steppers[port].setRealtime(rt_priority, rt_cpu))
+                bprintlf("Stepper %u runs without the real-time settings of the shield", port + 1);
         }
-        std::lock_guard<std::mutex> lock(handler_lock);
-        lib_steppers.push_back((void *)&steppers[port]);
         return &steppers[port];
     }
 
+    bool _Catchable MotorShield::stepCoordinated(uint32_t steps1, MotorDir dir1, uint32_t steps2, MotorDir dir2, MotorStyle style, bool blocking)
+    {
+        if (!steppers[0].initd || !steppers[1].initd)
+        {
+            bprintlf("Both steppers have to be initialized for a coordinated move.");
+            return false;
+        }
+        if (!steppers[0].stepsValid(steps1, style) || !steppers[1].stepsValid(steps2, style))
+        {
+            dbprintlf("Coordinated move too long.");
+            return false;
+        }
+        uint32_t ticks1 = style == MICROSTEP ? (uint32_t)steps1 * steppers[0].microsteps : steps1;
+        uint32_t ticks2 = style == MICROSTEP ? (uint32_t)steps2 * steppers[1].microsteps : steps2;
+        if ((ticks2 > ticks1 ? steppers[1].usperstep : steppers[0].usperstep) == 0)
+            throw std::runtime_error("RPM has to be set before stepping the motor.");
+        StepperMotor &mot = steppers[0];
+        std::unique_lock<std::mutex> lock(mot.queue_lock);
+        mot.done_cond.wait(lock, [&mot]() { return mot.qstaged - mot.qhead < ADAFRUIT_STEPPER_QUEUE_DEPTH; });
+        StepperMotorTimerData &data = mot.pushCommand(steps1, dir1, style, NULL, NULL);
+        data.peer = &steppers[1];
+        data.peer_steps = steps2;
+        data.peer_dir = dir2;
+        data.peer_stop_gen = steppers[1].stop_gen.load();
+        {
+            std::lock_guard<std::mutex> peer_lock(steppers[1].queue_lock);
+            steppers[1].plan(style == MICROSTEP ? steps2 * steppers[1].microsteps : steps2, dir2, style);
+        }
+        mot.publish(lock, blocking);
+        return true;
+    }
+
     /*************** Motors ****************/
     /***************************************/
 
@@ -495,51 +895,133 @@ namespace Adafruit
         MC = NULL;
         initd = false;
         PWMpin = IN1pin = IN2pin = 0;
+        dir = RELEASE;
+        pwm = 0;
+        ramping = false;
+        ramp_from = ramp_to = 0;
+        ramp_start = ramp_len = 0;
     }
 
     void DCMotor::run(MotorDir cmd)
     {
+        // IN1 and IN2 are adjacent channels, both change on the same transaction so there is no 'break'
+        uint8_t first = IN1pin < IN2pin ? IN1pin : IN2pin;
+        uint8_t regs[4 * 2];
         switch (cmd)
         {
         case FORWARD:
-            MC->setPin(IN2pin, LOW); // take low first to avoid 'break'
-            MC->setPin(IN1pin, HIGH);
+            encodePin(&regs[4 * (IN2pin - first)], LOW);
+            encodePin(&regs[4 * (IN1pin - first)], HIGH);
             break;
         case BACKWARD:
-            MC->setPin(IN1pin, LOW); // take low first to avoid 'break'
-            MC->setPin(IN2pin, HIGH);
+            encodePin(&regs[4 * (IN1pin - first)], LOW);
+            encodePin(&regs[4 * (IN2pin - first)], HIGH);
             break;
         case RELEASE:
-            MC->setPin(IN1pin, LOW);
-            MC->setPin(IN2pin, LOW);
+            encodePin(&regs[4 * (IN1pin - first)], LOW);
+            encodePin(&regs[4 * (IN2pin - first)], LOW);
             break;
         case BRAKE:
             dbprintlf("Feature not implemented.");
-            break;
+            return;
         default:
             dbprintlf("Direction %u unknown", cmd);
-            break;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(MC->ramp_lock);
+            cancelRamp();
+            dir = cmd;
         }
+        MC->submitChannels(first, 2, regs);
     }
 
     void DCMotor::setSpeed(uint8_t speed)
     {
-        MC->setPWM(PWMpin, speed * 16);
+        setSpeedFine(speed * 16);
     }
 
     void DCMotor::setSpeedFine(uint16_t speed)
     {
-        MC->setPWM(PWMpin, speed > 4095 ? 4095 : speed);
-    }
+        uint8_t regs[4];
+        if (speed > 4095)
+            speed = 4095;
+        encodePWM(regs, speed);
+        {
+            // a ramp tick either ran before, or sees the ramp cancelled; its write is queued before this one
+            std::lock_guard<std::mutex> lock(MC->ramp_lock);
+            cancelRamp();
+            pwm = speed;
+        }
+        MC->submitChannels(PWMpin, 1, regs);
+    }
 
     void DCMotor::fullOff()
     {
-        MC->setPWM(PWMpin, 0);
+        setSpeedFine(0);
     }
 
     void DCMotor::fullOn()
     {
-        MC->setPWM(PWMpin, 4095);
+        setSpeedFine(4095);
+    }
+
+    bool DCMotor::rampTo(int16_t speed, uint32_t duration_ms)
+    {
+        if (!initd)
+        {
+            bprintlf("DC motor not initialized, please invoke MotorShield::getMotor().");
+            return false;
+        }
+        if (speed > 4095)
+            speed = 4095;
+        else if (speed < -4095)
+            speed = -4095;
+        if (duration_ms == 0)
+        {
+            run(speed < 0 ? BACKWARD : speed > 0 ? FORWARD : RELEASE);
+            setSpeedFine(speed < 0 ? -speed : speed);
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(MC->ramp_lock);
+        if (!MC->ramper.joinable() && !MC->startRamper())
+            return false;
+        uint64_t now = monotonicNs();
+        ramp_from = current(now);
+        ramp_to = speed;
+        ramp_start = now;
+        ramp_len = duration_ms * 1000000LLU;
+        if (!ramping)
+            MC->ramps_active++;
+        ramping = true;
+        MC->ramp_cond.notify_one();
+        return true;
+    }
+
+    bool DCMotor::isRamping() const
+    {
+        std::lock_guard<std::mutex> lock(MC->ramp_lock);
+        return ramping;
+    }
+
+    int32_t DCMotor::current(uint64_t now) const
+    {
+        if (ramping)
+        {
+            if (now - ramp_start >= ramp_len)
+                return ramp_to;
+            return ramp_from + (int32_t)((int64_t)(ramp_to - ramp_from) * (int64_t)(now - ramp_start) / (int64_t)ramp_len);
+        }
+        return dir == FORWARD ? pwm : dir == BACKWARD ? -(int32_t)pwm : 0;
+    }
+
+    void DCMotor::cancelRamp()
+    {
+        // call with the ramp_lock of the shield held
+        if (!ramping)
+            return;
+        ramping = false;
+        MC->ramps_active--;
     }
 
     /*************** Motors ****************/
@@ -554,30 +1036,187 @@ namespace Adafruit
         MC = nullptr;
         microsteps = STEP16;
         initd = false;
-        microstepcurve = microstepcurve16;
+        lastentry = nullptr;
         usperstep = 0;
-        stop = false;
+        stop_gen = 0;
         moving = false;
+        qhead = qtail = qstaged = completed = 0;
+        position = planned = 0;
+        plannedstep = 0;
+        timerfd = -1;
+        donefd = -1;
+        quit = false;
+        ramp_profile = RAMP_NONE;
+        ramp_accel = ramp_start_rpm = 0;
+        memset(&ramp, 0x0, sizeof(ramp));
+        speed_gen = 0;
+        speed_seen = 0;
+        tick_deadline = 0;
+        overruns = 0;
+        hold_percent = 100;
+        hold_delay_ms = ADAFRUIT_STEPPER_HOLD_DELAY_MS;
+        hold_since = 0;
+        cbhead = cbtail = 0;
+        cb_every = 1;
+        cb_interval_ms = cb_dropped = 0;
+        cb_count = 0;
+        cb_last_ns = 0;
+        cb_sleeping = cb_quit = false;
+        cbfd = -1;
+        resetStats();
+        memset(results, 0x0, sizeof(results));
+    }
+
+    StepperMotor::~StepperMotor()
+    {
+        stopWorker();
+    }
+
+    bool StepperMotor::startWorker()
+    {
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timerfd < 0)
+        {
+            dbprintlf("Error %d creating step timer: %s", errno, strerror(errno));
+            return false;
+        }
+        donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (donefd < 0)
+        {
+            dbprintlf("Error %d creating completion event: %s", errno, strerror(errno));
+            close(timerfd);
+            timerfd = -1;
+            return false;
+        }
+        cbfd = eventfd(0, EFD_CLOEXEC);
+        if (cbfd < 0)
+        {
+            dbprintlf("Error %d creating callback event: %s", errno, strerror(errno));
+            close(timerfd);
+            timerfd = -1;
+            close(donefd);
+            donefd = -1;
+            return false;
+        }
+        quit = false;
+        cb_quit = false;
+        worker = std::thread(workerFn, this);
+        dispatcher = std::thread(dispatcherFn, this);
+        return true;
+    }
+
+    void StepperMotor::stopWorker()
+    {
+        if (!worker.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(queue_lock);
+            quit = true;
+            stop_gen++;
+        }
+        cond.notify_all();
+        worker.join();
+        // callbacks already queued are still delivered
+        cb_quit = true;
+        uint64_t one = 1;
+        if (write(cbfd, &one, sizeof(one)) < 0)
+            dbprintlf("Error %d waking up callback thread: %s", errno, strerror(errno));
+        dispatcher.join();
+        close(timerfd);
+        timerfd = -1;
+        close(donefd);
+        donefd = -1;
+        close(cbfd);
+        cbfd = -1;
+    }
+
+    int StepperMotor::getEventFd() const
+    {
+        return donefd;
+    }
+
+    bool StepperMotor::setRealtime(int priority, int cpu)
+    {
+        if (!initd || !worker.joinable())
+        {
+            dbprintlf("Stepper motor not initialized.");
+            return false;
+        }
+        return setThreadRealtime(worker, priority, cpu, "stepping");
+    }
+
+    MoveStatus StepperMotor::moveResult(uint32_t ticket, uint32_t &steps, int64_t timeout_us)
+    {
+        std::unique_lock<std::mutex> lock(queue_lock);
+        auto done = [this, ticket]() { return (int32_t)(completed - ticket) >= 0; };
+        if (timeout_us < 0)
+            done_cond.wait(lock, done);
+        else if (!done_cond.wait_for(lock, std::chrono::microseconds(timeout_us), done))
+            return MOVE_PENDING;
+        const StepperMotorMoveResult &res = results[ticket % ADAFRUIT_STEPPER_RESULT_DEPTH];
+        if (res.ticket != ticket)
+            return MOVE_EXPIRED;
+        steps = res.steps;
+        return res.status;
+    }
+
+    void StepperMotor::notifyCompleted(uint32_t count)
+    {
+        completed += count;
+        done_cond.notify_all();
+        uint64_t val = count;
+        if (count && write(donefd, &val, sizeof(val)) < 0)
+            dbprintlf("Error %d signaling completion: %s", errno, strerror(errno));
     }
 
     void StepperMotor::release(void)
     {
-        MC->setPin(AIN1pin, LOW);
-        MC->setPin(AIN2pin, LOW);
-        MC->setPin(BIN1pin, LOW);
-        MC->setPin(BIN2pin, LOW);
-        MC->setPWM(PWMApin, 0);
-        MC->setPWM(PWMBpin, 0);
+        uint8_t regs[4 * 6];
+        memset(regs, 0x0, sizeof(regs)); // all pins LOW, both PWM outputs 0
+        MC->writeChannels(PWMApin, 6, regs);
+        lastentry = nullptr;
     }
 
     bool _Catchable StepperMotor::setSpeed(double rpm)
     {
         if (rpm <= 0)
             throw std::runtime_error("Motor speed can not be negative or zero.");
+        std::lock_guard<std::mutex> lock(queue_lock);
+        usperstep = 60000000ULL / ((uint32_t)revsteps * rpm);
+        speed_gen++;
+        return true;
+    }
+
+    uint64_t StepperMotor::tickPeriod(MotorStyle style)
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        uint64_t uspers = usperstep;
+        if (style == INTERLEAVE)
+            uspers /= 2;
+        else if (style == MICROSTEP)
+            uspers /= microsteps;
+        speed_seen = speed_gen;
+        return uspers > 0 ? uspers * 1000LLU : 1000LLU;
+    }
+
+    bool StepperMotor::setRamp(RampProfile profile, double accel, double start_rpm)
+    {
+        if (profile != RAMP_NONE && profile != RAMP_TRAPEZOIDAL && profile != RAMP_SCURVE)
+        {
+            dbprintlf("Ramp profile %u unknown", profile);
+            return false;
+        }
+        if (profile != RAMP_NONE && accel <= 0)
+        {
+            dbprintlf("Acceleration has to be positive.");
+            return false;
+        }
         std::unique_lock<std::mutex> lock(cs, std::try_to_lock);
         if (lock.owns_lock())
         {
-            usperstep = 60000000ULL / ((uint32_t)revsteps * rpm);
+            ramp_profile = profile;
+            ramp_accel = accel;
+            ramp_start_rpm = start_rpm;
             return true;
         }
         return false;
@@ -588,13 +1227,13 @@ namespace Adafruit
         std::unique_lock<std::mutex> lock(cs, std::try_to_lock);
         if (lock.owns_lock())
         {
+            MicroSteps old = this->microsteps, next;
             switch (microsteps)
             {
 #ifndef _DOXYGEN_
-#define MCASE(x)                            \
-    case (STEP##x):                         \
-        this->microsteps = STEP##x;         \
-        microstepcurve = microstepcurve##x; \
+#define MCASE(x)        \
+    case (STEP##x):     \
+        next = STEP##x; \
         break;
 #endif // _DOXYGEN_
 
@@ -609,334 +1248,985 @@ namespace Adafruit
 
             default:
                 dbprintlf("Microsteps %u not valid, setting microsteps to %u", (uint8_t)microsteps, (uint8_t)STEP16);
-                this->microsteps = STEP16;
-                microstepcurve = microstepcurve16;
+                next = STEP16;
                 break;
             }
+            // keep the phase and the position in the new microstep units, which must hold them exactly
+            std::lock_guard<std::mutex> qlock(queue_lock);
+            if (next < old)
+            {
+                int64_t ratio = old / next;
+                if (position % ratio || planned % ratio || currentstep % ratio || plannedstep % ratio)
+                {
+                    dbprintlf("Position %" PRId64 " is not a whole number of microsteps at %u microsteps per step", planned, next);
+                    return false;
+                }
+            }
+            this->microsteps = next;
+            currentstep = (uint32_t)currentstep * next / old;
+            position = position * next / old;
+            planned = planned * next / old;
+            plannedstep = (uint32_t)plannedstep * next / old;
             return true;
         }
         return false;
     }
 
-    void _Catchable StepperMotor::step(uint16_t steps, MotorDir dir, MotorStyle style, bool blocking, StepperMotorCB_t callback_fn, void *callback_fn_data)
+    void _Catchable StepperMotor::step(uint32_t steps, MotorDir dir, MotorStyle style, bool blocking, StepperMotorCB_t callback_fn, void *callback_fn_data)
     {
-        if (usperstep == 0)
-            throw std::runtime_error("RPM has to be set before stepping the motor.");
-        if (blocking)
+        const char *err = moveError(steps, style);
+        if (err != nullptr)
+            throw std::runtime_error(err);
+        queueMove(steps, dir, style, blocking, callback_fn, callback_fn_data);
+    }
+
+    MoveHandle _Catchable StepperMotor::stepAsync(uint32_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data)
+    {
+        const char *err = moveError(steps, style);
+        if (err != nullptr)
+            throw std::runtime_error(err);
+        return MoveHandle(this, queueMove(steps, dir, style, false, callback_fn, callback_fn_data));
+    }
+
+    bool StepperMotor::stepAsync(MoveHandle &handle, uint32_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data)
+    {
+        const char *err = moveError(steps, style);
+        if (err != nullptr)
         {
-            std::unique_lock<std::mutex> lock(cs);
-            uint64_t uspers = usperstep;
+            dbprintlf("%s", err);
+            return false;
+        }
+        handle = MoveHandle(this, queueMove(steps, dir, style, false, callback_fn, callback_fn_data));
+        return true;
+    }
 
-            if (style == INTERLEAVE)
-            {
-                uspers /= 2;
-            }
-            else if (style == MICROSTEP)
-            {
-                uspers /= microsteps;
-                steps *= microsteps;
-                dbprintlf("steps = %d", steps);
-            }
-            stop = false;
-            StepperMotorTimerData data = {this, steps, dir, style, microsteps, callback_fn, callback_fn_data};
-            clkgen_t clk = create_clk(uspers * 1000LLU, stepHandlerFn, &data);
-            if (cond.wait_for(lock, std::chrono::microseconds(steps * uspers)) == std::cv_status::timeout)
-            {
-                while (data.steps)
-                {
-                    usleep(uspers);
-                }
-            }
-            destroy_clk(clk);
-            moving = false;
+    bool StepperMotor::enqueue(uint32_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data)
+    {
+        const char *err = moveError(steps, style);
+        if (err != nullptr)
+        {
+            dbprintlf("%s", err);
+            return false;
         }
-        else // non-blocking, spawn thread
+        std::lock_guard<std::mutex> lock(queue_lock);
+        if (qstaged - qhead >= ADAFRUIT_STEPPER_QUEUE_DEPTH)
         {
-            std::thread stepThread(stepThreadFn, this, steps, dir, style, callback_fn, callback_fn_data);
-            stepThread.detach();
+            dbprintlf("Stepping queue full.");
+            return false;
         }
+        pushCommand(steps, dir, style, callback_fn, callback_fn_data);
+        return true;
     }
 
-    bool StepperMotor::isMoving() const
+    void StepperMotor::flush()
     {
-        return moving;
+        std::lock_guard<std::mutex> lock(queue_lock);
+        if (qtail != qstaged)
+        {
+            qtail = qstaged;
+            cond.notify_one();
+        }
     }
 
-    void StepperMotor::stopMotor()
+    void StepperMotor::waitIdle()
     {
-        if (moving)
-            stop = true;
+        std::unique_lock<std::mutex> lock(queue_lock);
+        done_cond.wait(lock, [this]() { return (int32_t)(completed - qtail) >= 0; });
     }
 
-    uint64_t _Catchable StepperMotor::getStepPeriod() const
+    StepperMotorTimerData &StepperMotor::pushCommand(uint32_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data, bool raw)
     {
-        if (usperstep == 0)
-            throw std::runtime_error("RPM has to be set before stepping the motor.");
-        return usperstep;
+        plan(raw ? steps : style == MICROSTEP ? steps * microsteps : steps, dir, style);
+        StepperMotorTimerData &data = queue[qstaged % ADAFRUIT_STEPPER_QUEUE_DEPTH];
+        data.raw = raw;
+        data.steps = steps;
+        data.dir = dir;
+        data.style = style;
+        data.callback_fn = callback_fn;
+        data.callback_user_data = callback_fn_data;
+        data.peer = nullptr;
+        data.stop_gen = stop_gen.load();
+        data.estop_halts = estop_halts.load();
+        qstaged++;
+        return data;
     }
 
-    uint8_t StepperMotor::onestep(MotorDir dir, MotorStyle style)
+    uint32_t StepperMotor::publish(std::unique_lock<std::mutex> &lock, bool blocking)
     {
-        uint16_t ocrb, ocra;
-
-        ocra = ocrb = 4095;
-
-        // next determine what sort of stepping procedure we're up to
-        if (style == SINGLE)
-        {
-            if ((currentstep / (microsteps / 2)) % 2)
-            { // we're at an odd step, weird
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps / 2;
-                }
-                else
-                {
-                    currentstep -= microsteps / 2;
-                }
-            }
-            else
-            { // go to the next even step
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps;
-                }
-                else
-                {
-                    currentstep -= microsteps;
-                }
-            }
-        }
-        else if (style == DOUBLE)
-        {
-            if (!(currentstep / (microsteps / 2) % 2))
-            { // we're at an even step, weird
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps / 2;
-                }
-                else
-                {
-                    currentstep -= microsteps / 2;
-                }
-            }
-            else
-            { // go to the next odd step
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps;
-                }
-                else
-                {
-                    currentstep -= microsteps;
-                }
-            }
-        }
-        else if (style == INTERLEAVE)
+        uint32_t ticket = qtail = qstaged;
+        cond.notify_one();
+        if (blocking)
         {
-            if (dir == FORWARD)
-            {
-                currentstep += microsteps / 2;
-            }
-            else
-            {
-                currentstep -= microsteps / 2;
-            }
+            done_cond.wait(lock, [this, ticket]() { return (int32_t)(completed - ticket) >= 0; });
         }
+        return ticket;
+    }
 
-        if (style == MICROSTEP)
+    uint32_t StepperMotor::queueMove(uint32_t steps, MotorDir dir, MotorStyle style, bool blocking, StepperMotorCB_t callback_fn, void *callback_fn_data)
+    {
+        std::unique_lock<std::mutex> lock(queue_lock);
+        done_cond.wait(lock, [this]() { return qstaged - qhead < ADAFRUIT_STEPPER_QUEUE_DEPTH; });
+        pushCommand(steps, dir, style, callback_fn, callback_fn_data);
+        uint32_t ticket = publish(lock, blocking);
+        if (blocking && callback_fn != nullptr)
         {
-            if (dir == FORWARD)
-            {
-                currentstep++;
-            }
-            else
-            {
-                // BACKWARDS
-                currentstep--;
-            }
-
-            currentstep += microsteps * 4;
-            currentstep %= microsteps * 4;
-
-            ocra = ocrb = 0;
-            if (currentstep < microsteps)
-            {
-                ocra = microstepcurve[microsteps - currentstep];
-                ocrb = microstepcurve[currentstep];
-            }
-            else if ((currentstep >= microsteps) && (currentstep < microsteps * 2))
-            {
-                ocra = microstepcurve[currentstep - microsteps];
-                ocrb = microstepcurve[microsteps * 2 - currentstep];
-            }
-            else if ((currentstep >= microsteps * 2) &&
-                     (currentstep < microsteps * 3))
-            {
-                ocra = microstepcurve[microsteps * 3 - currentstep];
-                ocrb = microstepcurve[currentstep - microsteps * 2];
-            }
-            else if ((currentstep >= microsteps * 3) &&
-                     (currentstep < microsteps * 4))
-            {
-                ocra = microstepcurve[currentstep - microsteps * 3];
-                ocrb = microstepcurve[microsteps * 4 - currentstep];
-            }
+            lock.unlock(); // callbacks may use the motor
+            waitCallbacks();
         }
+        return ticket;
+    }
 
-        currentstep += microsteps * 4;
-        currentstep %= microsteps * 4;
+    bool StepperMotor::stepsValid(uint32_t steps, MotorStyle style) const
+    {
+        // the worker counts microstepping moves in microsteps
+        return style != MICROSTEP || steps <= UINT32_MAX / microsteps;
+    }
 
-        dbprintlf("current step: %u, pwmA = %u, pwmB = %u", currentstep, ocra, ocrb);
-        MC->setPWM(PWMApin, ocra);
-        MC->setPWM(PWMBpin, ocrb);
+    const char *StepperMotor::moveError(uint32_t steps, MotorStyle style) const
+    {
+        if (usperstep == 0)
+            return "RPM has to be set before stepping the motor.";
+        if (!stepsValid(steps, style))
+            return "Move too long for the microstep setting.";
+        return nullptr;
+    }
 
-        // release all
-        uint8_t latch_state = 0; // all motor pins to 0
+    int64_t StepperMotor::stepDistance(uint32_t steps, MotorStyle style) const
+    {
+        if (style == INTERLEAVE)
+            return (int64_t)steps * (microsteps / 2);
+        return (int64_t)steps * microsteps;
+    }
 
+    void StepperMotor::plan(uint32_t ticks, MotorDir dir, MotorStyle style)
+    {
+        // same phase arithmetic as nextStep, for all ticks of a command at once
+        uint32_t nsteps = microsteps * 4;
+        uint32_t half = microsteps / 2;
+        int64_t dist;
         if (style == MICROSTEP)
         {
-            if (currentstep < microsteps)
-                latch_state |= 0x03;
-            if ((currentstep >= microsteps) && (currentstep < microsteps * 2))
-                latch_state |= 0x06;
-            if ((currentstep >= microsteps * 2) && (currentstep < microsteps * 3))
-                latch_state |= 0x0C;
-            if ((currentstep >= microsteps * 3) && (currentstep < microsteps * 4))
-                latch_state |= 0x09;
+            dist = ticks;
+            plannedstep = (plannedstep + (dir == FORWARD ? ticks : nsteps - ticks % nsteps)) % nsteps;
         }
         else
         {
-            switch (currentstep / (microsteps / 2))
+            uint32_t halfstep = plannedstep / half;
+            uint32_t halves = ticks;
+            if (style != INTERLEAVE && ticks)
             {
-            case 0:
-                latch_state |= 0x1; // energize coil 1 only
-                break;
-            case 1:
-                latch_state |= 0x3; // energize coil 1+2
-                break;
-            case 2:
-                latch_state |= 0x2; // energize coil 2 only
-                break;
-            case 3:
-                latch_state |= 0x6; // energize coil 2+3
-                break;
-            case 4:
-                latch_state |= 0x4; // energize coil 3 only
-                break;
-            case 5:
-                latch_state |= 0xC; // energize coil 3+4
-                break;
-            case 6:
-                latch_state |= 0x8; // energize coil 4 only
-                break;
-            case 7:
-                latch_state |= 0x9; // energize coil 1+4
-                break;
+                // SINGLE moves to an even half step first, DOUBLE to an odd one, then by full steps
+                bool aligned = (halfstep & 0x1) == (style == DOUBLE ? 1 : 0);
+                halves = aligned ? 2 * ticks : 2 * ticks - 1;
             }
+            halfstep = (halfstep + (dir == FORWARD ? halves : 8 - halves % 8)) & 0x7;
+            plannedstep = halfstep * half + plannedstep % half;
+            dist = (int64_t)halves * half;
         }
-        dbprintlf("Latch: 0x%02x", latch_state);
+        planned += dir == FORWARD ? dist : -dist;
+    }
 
-        if (latch_state & 0x1)
-        {
-            MC->setPin(AIN2pin, HIGH);
-        }
-        else
+    int64_t StepperMotor::getPosition() const
+    {
+        return position.load(std::memory_order_relaxed);
+    }
+
+    bool StepperMotor::getStats(StepperMotorStats &stats) const
+    {
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        statsRead(stat_lateness, stats.lateness);
+        stats.ticks = stat_ticks.load(std::memory_order_relaxed);
+        stats.missed = stat_missed.load(std::memory_order_relaxed);
+        return true;
+#else
+        memset(&stats, 0x0, sizeof(stats));
+        return false;
+#endif
+    }
+
+    void StepperMotor::resetStats()
+    {
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        statsClear(stat_lateness);
+        stat_ticks = stat_missed = 0;
+#endif
+    }
+
+    uint32_t StepperMotor::getOverruns() const
+    {
+        return overruns.load(std::memory_order_relaxed);
+    }
+
+    bool StepperMotor::setHoldCurrent(uint8_t percent, uint32_t idle_ms)
+    {
+        if (percent > 100)
         {
-            MC->setPin(AIN2pin, LOW);
+            bprintlf("Hold current %u%% out of range [0-100]", percent);
+            return false;
         }
-        if (latch_state & 0x2)
+        // a move in progress holds cs, runs at full current and arms the hold timeout when it ends
+        std::unique_lock<std::mutex> lock(cs, std::try_to_lock);
+        bool held = lock.owns_lock() && lastentry != nullptr;
+        StepperMotorStepEntry entry;
+        if (held)
+            entry = *lastentry;
+        uint8_t old;
         {
-            MC->setPin(BIN1pin, HIGH);
+            std::lock_guard<std::mutex> qlock(queue_lock);
+            old = hold_percent;
+            hold_percent = percent;
+            hold_delay_ms = idle_ms;
+            if (lock.owns_lock())
+                hold_since = held ? monotonicNs() : 0;
+            cond.notify_one();
         }
-        else
+        if (held && old < 100)
         {
-            MC->setPin(BIN1pin, LOW);
+            // back to the full current, in case it was reduced with the previous setting
+            StepperMotorStepEntry hold;
+            fillStepEntry(&hold, entry.pwma * old / 100, entry.pwmb * old / 100, entry.latch);
+            MC->swapChannels(PWMApin, 6, hold.regs, entry.regs);
         }
-        if (latch_state & 0x4)
+        return true;
+    }
+
+    void StepperMotor::armHold()
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        if (hold_percent >= 100 || lastentry == nullptr)
+            return;
+        hold_since = monotonicNs();
+        cond.notify_one();
+    }
+
+    void StepperMotor::reduceHold(uint8_t percent)
+    {
+        std::unique_lock<std::mutex> lock(cs, std::try_to_lock);
+        if (!lock.owns_lock() || lastentry == nullptr)
+            return; // moving again, or released
+        StepperMotorStepEntry entry = *lastentry, hold; // steps rewrite stepentry holding cs
+        fillStepEntry(&hold, entry.pwma * percent / 100, entry.pwmb * percent / 100, entry.latch);
+        // only if the coils still hold the last step, not after release(), allOff() or an emergency stop
+        if (MC->swapChannels(PWMApin, 6, entry.regs, hold.regs))
+            dbprintlf("Hold current of stepper on PWM %u reduced to %u%%", PWMApin, percent);
+    }
+
+    bool StepperMotor::setCallbackRate(uint32_t every_steps, uint32_t min_interval_ms)
+    {
+        if (every_steps == 0)
         {
-            MC->setPin(AIN1pin, HIGH);
+            dbprintlf("Callback rate has to be at least one per step.");
+            return false;
         }
-        else
+        cb_every = every_steps;
+        cb_interval_ms = min_interval_ms;
+        return true;
+    }
+
+    uint32_t StepperMotor::getDroppedCallbacks() const
+    {
+        return cb_dropped.load(std::memory_order_relaxed);
+    }
+
+    void StepperMotor::notifyStep(const StepperMotorTimerData &data)
+    {
+        // called from the stepping thread, never blocks
+        if (data.callback_fn == nullptr || ++cb_count < cb_every.load(std::memory_order_relaxed))
+            return;
+        uint32_t interval_ms = cb_interval_ms.load(std::memory_order_relaxed);
+        if (interval_ms)
         {
-            MC->setPin(AIN1pin, LOW);
+            uint64_t now = monotonicNs();
+            if (now - cb_last_ns < interval_ms * 1000000LLU)
+                return;
+            cb_last_ns = now;
         }
-        if (latch_state & 0x8)
+        cb_count = 0;
+        uint32_t tail = cbtail.load(std::memory_order_relaxed);
+        if (tail - cbhead.load(std::memory_order_acquire) >= ADAFRUIT_STEPPER_CALLBACK_DEPTH)
         {
-            MC->setPin(BIN2pin, HIGH);
+            cb_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
         }
-        else
+        StepperMotorNotification &n = cbqueue[tail % ADAFRUIT_STEPPER_CALLBACK_DEPTH];
+        n.callback_fn = data.callback_fn;
+        n.callback_user_data = data.callback_user_data;
+        cbtail.store(tail + 1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in dispatcherFn
+        if (cb_sleeping.load(std::memory_order_relaxed))
         {
-            MC->setPin(BIN2pin, LOW);
+            uint64_t one = 1;
+            if (write(cbfd, &one, sizeof(one)) < 0)
+                dbprintlf("Error %d waking up callback thread: %s", errno, strerror(errno));
         }
+    }
 
-        return currentstep;
+    void StepperMotor::waitCallbacks()
+    {
+        uint32_t tail = cbtail.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(cb_lock);
+        cb_cond.wait(lock, [this, tail]() { return (int32_t)(cbhead.load(std::memory_order_acquire) - tail) >= 0; });
     }
 
-    void StepperMotor::stepHandlerFn(clkgen_t clk, void *data_)
+    void StepperMotor::dispatcherFn(StepperMotor *mot)
     {
-        struct StepperMotorTimerData *data = (struct StepperMotorTimerData *)data_;
-        StepperMotor *_this = data->_this;
-        // if at odd microstep we HAVE to step until we reach an integral step
-        if ((data->steps % data->msteps) && (data->style == MotorStyle::MICROSTEP))
+        while (true)
         {
-            _this->moving = true;
-            _this->onestep(data->dir, data->style);
-            data->steps--;
-            if (data->callback_fn != nullptr)
+            uint32_t head = mot->cbhead.load(std::memory_order_relaxed);
+            if (head != mot->cbtail.load(std::memory_order_acquire))
             {
-                data->callback_fn(_this, data->callback_user_data);
+                StepperMotorNotification n = mot->cbqueue[head % ADAFRUIT_STEPPER_CALLBACK_DEPTH];
+                n.callback_fn(mot, n.callback_user_data);
+                {
+                    std::lock_guard<std::mutex> lock(mot->cb_lock);
+                    mot->cbhead.store(head + 1, std::memory_order_release);
+                }
+                mot->cb_cond.notify_all();
+                continue;
             }
-            return; // can not let this reach the unblock check
-        }
-        else if (data->steps && !(_this->stop)) // integral step/not microstepping, no Ctrl+C received, emergency stop not pressed
-        {
-            _this->moving = true;
-            _this->onestep(data->dir, data->style);
-            if (data->callback_fn != nullptr)
+            if (mot->cb_quit)
+                break;
+            mot->cb_sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in notifyStep
+            if (head == mot->cbtail.load(std::memory_order_acquire) && !mot->cb_quit)
             {
-                data->callback_fn(_this, data->callback_user_data);
+                uint64_t val;
+                if (read(mot->cbfd, &val, sizeof(val)) < 0 && errno != EINTR)
+                    dbprintlf("Error %d waiting for callbacks: %s", errno, strerror(errno));
             }
-            data->steps--;
+            mot->cb_sleeping = false;
         }
-        if (data->steps == 0 || _this->stop) // end reached/done = 1
+    }
+
+    bool StepperMotor::setPosition(int64_t position)
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        if (completed != qstaged || moving)
         {
-            _this->moving = false;
-            _this->cond.notify_all();
+            dbprintlf("Can not set position while the motor is moving.");
+            return false;
         }
+        this->position = planned = position;
+        plannedstep = currentstep;
+        return true;
     }
 
-    void StepperMotor::stepThreadFn(StepperMotor *mot, uint16_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data)
+    bool _Catchable StepperMotor::goTo(int64_t position, MotorStyle style, bool blocking)
     {
-        std::unique_lock<std::mutex> lock(mot->cs);
-        uint64_t uspers = mot->usperstep;
-
-        if (style == INTERLEAVE)
+        if (!initd)
         {
-            uspers /= 2;
+            bprintlf("Stepper motor not initialized, please invoke MotorShield::getStepper().");
+            return false;
         }
-        else if (style == MICROSTEP)
+        if (usperstep == 0)
+            throw std::runtime_error("RPM has to be set before stepping the motor.");
+        std::unique_lock<std::mutex> lock(queue_lock);
+        done_cond.wait(lock, [this]() { return qstaged - qhead < ADAFRUIT_STEPPER_QUEUE_DEPTH; });
+        if (completed == qstaged && !moving)
+        {
+            // idle, also picks up moves that were stopped early
+            planned = this->position;
+            plannedstep = currentstep;
+        }
+        int64_t delta = position - planned;
+        uint64_t dist = delta < 0 ? -(uint64_t)delta : delta;
+        bool raw = style == MICROSTEP; // microstepping moves are counted in microsteps, not steps
+        uint64_t steps = raw ? dist : dist / stepDistance(1, style);
+        if (steps > UINT32_MAX)
+        {
+            dbprintlf("Move to %" PRId64 " too long.", position);
+            return false;
+        }
+        if (steps == 0)
+            return true;
+        pushCommand(steps, delta < 0 ? BACKWARD : FORWARD, style, NULL, NULL, raw);
+        publish(lock, blocking);
+        return true;
+    }
+
+    bool _Catchable StepperMotor::moveRelative(int32_t steps, MotorStyle style, bool blocking)
+    {
+        if (!initd)
+        {
+            bprintlf("Stepper motor not initialized, please invoke MotorShield::getStepper().");
+            return false;
+        }
+        uint32_t dist = steps < 0 ? -(uint32_t)steps : steps;
+        if (!stepsValid(dist, style))
+        {
+            dbprintlf("Move of %d steps too long.", steps);
+            return false;
+        }
+        step(dist, steps < 0 ? BACKWARD : FORWARD, style, blocking);
+        return true;
+    }
+
+    bool StepperMotor::isMoving() const
+    {
+        return moving;
+    }
+
+    void StepperMotor::stopMotor()
+    {
+        // also applies to moves the worker has not picked up yet, they carry the previous generation
+        std::lock_guard<std::mutex> lock(queue_lock);
+        stop_gen.fetch_add(1);
+        if (qtail != qstaged)
+        {
+            qtail = qstaged; // staged segments are cancelled along with the flushed ones
+            cond.notify_one();
+        }
+    }
+
+    uint64_t _Catchable StepperMotor::getStepPeriod() const
+    {
+        if (usperstep == 0)
+            throw std::runtime_error("RPM has to be set before stepping the motor.");
+        return usperstep;
+    }
+
+    uint8_t StepperMotor::onestep(MotorDir dir, MotorStyle style)
+    {
+        std::lock_guard<std::mutex> lock(cs); // not during a move, nor while the hold current is reduced
+        const StepperMotorStepEntry *entry = nextStep(dir, style);
+        MC->writeChannels(PWMApin, 6, entry->regs);
+        armHold();
+        return currentstep;
+    }
+
+    const StepperMotorStepEntry *StepperMotor::nextStep(MotorDir dir, MotorStyle style)
+    {
+        return (this->*stepKernel(style))(dir);
+    }
+
+    template <MotorStyle S, MicroSteps M>
+    const StepperMotorStepEntry *StepperMotor::stepT(MotorDir dir)
+    {
+        // S and M are constants here, so the style checks fold away and the divisions become shifts
+        const StepperMotorStepEntry *entry;
+        const int sign = dir == FORWARD ? 1 : -1;
+
+        if (S == MICROSTEP)
+        {
+            // one quarter of the sine period per coil energization, the curve runs backwards in every other quarter
+            static const uint8_t latches[4] = {0x03, 0x06, 0x0C, 0x09};
+            currentstep = (currentstep + sign) & (M * 4 - 1);
+            const uint16_t quarter = currentstep / M, point = currentstep % M;
+            const uint16_t a = quarter & 0x1 ? point : M - point;
+            fillStepEntry(&stepentry, MicrostepCurve<M>::value[a], MicrostepCurve<M>::value[M - a], latches[quarter]);
+            entry = &stepentry;
+            position.store(position.load(std::memory_order_relaxed) + sign, std::memory_order_relaxed);
+        }
+        else
+        {
+            // SINGLE, DOUBLE and INTERLEAVE move in half steps and keep any microstep offset
+            const uint16_t half = M / 2;
+            uint8_t halfstep = currentstep / half;
+            int incr = halfstepIncrement(S, halfstep & 0x1);
+            halfstep = (halfstep + sign * incr) & 0x7;
+            currentstep = halfstep * half + currentstep % half;
+            entry = &fullsteptable[halfstep];
+            position.store(position.load(std::memory_order_relaxed) + sign * incr * half, std::memory_order_relaxed);
+        }
+
+        dbprintlf("current step: %u, pwmA = %u, pwmB = %u, latch: 0x%02x", currentstep, entry->pwma, entry->pwmb, entry->latch);
+        lastentry = entry;
+        return entry;
+    }
+
+#ifndef _DOXYGEN_
+#define STEPPER_KERNELS(S)                                                  \
+    {                                                                       \
+        &StepperMotor::stepT<S, STEP8>, &StepperMotor::stepT<S, STEP16>,    \
+        &StepperMotor::stepT<S, STEP32>, &StepperMotor::stepT<S, STEP64>,   \
+        &StepperMotor::stepT<S, STEP128>, &StepperMotor::stepT<S, STEP256>, \
+        &StepperMotor::stepT<S, STEP512>                                    \
+    }
+#endif // _DOXYGEN_
+
+    StepperMotor::StepKernel StepperMotor::stepKernel(MotorStyle style) const
+    {
+        static const StepKernel kernels[5][7] = {
+            STEPPER_KERNELS(static_cast<MotorStyle>(0)), // invalid style, holds the current step
+            STEPPER_KERNELS(SINGLE),
+            STEPPER_KERNELS(DOUBLE),
+            STEPPER_KERNELS(INTERLEAVE),
+            STEPPER_KERNELS(MICROSTEP),
+        };
+        int idx = 0;
+        while ((STEP8 << idx) < microsteps)
+            idx++;
+        return kernels[style <= MICROSTEP ? style : 0][idx];
+    }
+#undef STEPPER_KERNELS
+
+    bool StepperMotor::stepHandlerFn(StepperMotorTimerData &data, StepKernel kernel)
+    {
+        // The stop is checked holding the bus, which the emergency stop holds to turn the outputs off after stopping
+        // the motor: a step either goes out before that, or sees the stop.
+        std::lock_guard<MotorShieldBus> lock(*MC->busmgr);
+        bool stop = stop_gen.load(std::memory_order_relaxed) != data.stop_gen;
+        if (stop && estop_halts.load() != data.estop_halts)
+            return true; // emergency stop, the outputs stay off
+        // if at odd microstep we HAVE to step until we reach an integral step
+        if ((data.steps % data.msteps) && (data.style == MotorStyle::MICROSTEP))
+        {
+            moving = true;
+            MC->writeChannels(PWMApin, 6, (this->*kernel)(data.dir)->regs);
+            data.steps--;
+            notifyStep(data);
+            return false; // can not let this reach the unblock check
+        }
+        else if (data.steps && !stop) // integral step/not microstepping, no Ctrl+C received, emergency stop not pressed
+        {
+            moving = true;
+            MC->writeChannels(PWMApin, 6, (this->*kernel)(data.dir)->regs);
+            notifyStep(data);
+            data.steps--;
+        }
+        return data.steps == 0 || stop; // end reached/done = 1
+    }
+
+    bool StepperMotor::runMove(StepperMotorTimerData &data, bool &scheduled)
+    {
+        if (data.style == MICROSTEP && !data.raw)
+        {
+            data.steps *= microsteps;
+            dbprintlf("steps = %d", data.steps);
+        }
+        data.msteps = microsteps;
+        if (data.peer != nullptr)
+            return runCoordinated(data, scheduled);
+        if (data.steps == 0)
+            return true;
+
+        uint64_t nsper = tickPeriod(data.style);
+        StepKernel kernel = stepKernel(data.style); // microsteps do not change during a move
+        bool ramped = ramp_profile != RAMP_NONE;
+        if (ramped)
+            startRamp(data, nsper);
+        cb_count = 0;
+        // A segment following another one continues its schedule, and takes its first step one period
+        // after the last step of the previous segment.
+        if (!scheduled)
+            tick_deadline = monotonicNs();
+        scheduled = true;
+        bool done = false;
+        while (!done)
+        {
+            if (speed_gen.load(std::memory_order_relaxed) != speed_seen)
+            {
+                // setSpeed() during the move, the next step is taken at the new speed
+                nsper = tickPeriod(data.style);
+                if (ramped)
+                    retune(nsper);
+            }
+            if (!waitTick(ramped ? rampPeriod(data.steps + ramp.lookahead) : nsper))
+                return false;
+            done = stepHandlerFn(data, kernel);
+        }
+        if (data.steps)
+            ramp.lookahead = 0; // stopped, next segment starts from standstill
+        return true;
+    }
+
+    bool StepperMotor::runCoordinated(StepperMotorTimerData &data, bool &scheduled)
+    {
+        StepperMotor *peer = data.peer;
+        std::lock_guard<std::mutex> lock(peer->cs); // wait for the other axis to finish its own moves
+        StepperMotor *mots[2] = {this, peer};
+        MotorDir dirs[2] = {data.dir, data.peer_dir};
+        uint32_t ticks[2] = {data.steps, data.peer_steps}; // data.steps already in microsteps
+        if (data.style == MICROSTEP)
+            ticks[1] *= peer->microsteps;
+        int major = ticks[1] > ticks[0] ? 1 : 0;
+        int minor = 1 - major;
+        StepperMotor *mj = mots[major];
+
+        uint64_t nsper = mj->tickPeriod(data.style);
+        if (ticks[major] == 0)
+            return true;
+
+        bool ramped = mj->ramp_profile != RAMP_NONE;
+        if (ramped)
+        {
+            StepperMotorTimerData mjdata = data;
+            mjdata.msteps = mj->microsteps;
+            mj->ramp.pos = mj->ramp.lookahead = 0;
+            mj->startRamp(mjdata, nsper);
+            mj->ramp.lookahead = 0; // queued moves of either axis are not part of this move
+        }
+        if (!scheduled)
+            tick_deadline = monotonicNs();
+        scheduled = true;
+
+        // channels 2-7 (port 2) and 8-13 (port 1) go out in one burst
+        uint8_t first = PWMApin < peer->PWMApin ? PWMApin : peer->PWMApin;
+        uint8_t regs[4 * 12];
+        StepKernel kernels[2] = {stepKernel(data.style), peer->stepKernel(data.style)};
+        uint32_t left[2] = {ticks[0], ticks[1]};
+        int64_t err = ticks[major] / 2;
+        moving = peer->moving = true;
+        while (left[major])
+        {
+            if (mj->speed_gen.load(std::memory_order_relaxed) != mj->speed_seen)
+            {
+                nsper = mj->tickPeriod(data.style);
+                if (ramped)
+                    mj->retune(nsper);
+            }
+            if (!waitTick(ramped ? mj->rampPeriod(left[major]) : nsper))
+                break;
+            std::lock_guard<MotorShieldBus> bus(*MC->busmgr); // see stepHandlerFn()
+            bool stop = stop_gen.load(std::memory_order_relaxed) != data.stop_gen ||
+                        peer->stop_gen.load(std::memory_order_relaxed) != data.peer_stop_gen;
+            if (stop && estop_halts.load() != data.estop_halts)
+                break;
+            // on stop, microstepping axes have to reach an integral step first
+            if (stop &&
+                (data.style != MICROSTEP || (left[0] % microsteps == 0 && left[1] % peer->microsteps == 0)))
+                break;
+            bool advance[2];
+            advance[major] = true;
+            err -= ticks[minor];
+            advance[minor] = err < 0 && left[minor];
+            if (err < 0)
+                err += ticks[major];
+            for (int i = 0; i < 2; i++)
+            {
+                if (advance[i])
+                {
+                    (mots[i]->*kernels[i])(dirs[i]);
+                    left[i]--;
+                }
+                const StepperMotorStepEntry *entry = mots[i]->lastentry;
+                uint8_t *dest = &regs[4 * (mots[i]->PWMApin - first)];
+                if (entry != nullptr)
+                    memcpy(dest, entry->regs, sizeof(entry->regs));
+                else
+                    memset(dest, 0x0, sizeof(entry->regs));
+            }
+            MC->writeChannels(first, 12, regs, true);
+        }
+        data.steps = left[0];
+        peer->moving = false;
+        return true;
+    }
+
+    bool StepperMotor::waitTick(uint64_t ns)
+    {
+        // Each (micro)step is scheduled at an absolute time one period after the previous one, so time spent
+        // taking a step (I2C transactions, callbacks) does not add up over a move.
+        tick_deadline += ns;
+        struct itimerspec its;
+        memset(&its, 0x0, sizeof(its));
+        its.it_value.tv_sec = tick_deadline / 1000000000LLU;
+        its.it_value.tv_nsec = tick_deadline % 1000000000LLU;
+        if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        {
+            dbprintlf("Error %d arming step timer: %s", errno, strerror(errno));
+            return false;
+        }
+        uint64_t expirations;
+        while (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        {
+            if (errno != EINTR)
+            {
+                dbprintlf("Error %d reading step timer: %s", errno, strerror(errno));
+                return false;
+            }
+        }
+        uint64_t now = monotonicNs();
+        uint64_t late = now > tick_deadline ? now - tick_deadline : 0;
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        statsRecord(stat_lateness, late);
+        stat_ticks.fetch_add(1, std::memory_order_relaxed);
+        if (late >= ns)
+            stat_missed.fetch_add(late / ns, std::memory_order_relaxed);
+#endif
+        // late steps are taken back to back until the schedule is caught up, unless it is too far behind
+        if (late > ADAFRUIT_STEPPER_MAX_CATCHUP * ns)
+        {
+            tick_deadline = now;
+            overruns.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    void StepperMotor::startRamp(const StepperMotorTimerData &data, uint64_t nsper)
+    {
+        // ramp in ticks, one tick is a call to onestep
+        double ticks_per_step = 1;
+        if (data.style == INTERLEAVE)
+            ticks_per_step = 2;
+        else if (data.style == MICROSTEP)
+            ticks_per_step = data.msteps;
+        double tick_rpm = revsteps * ticks_per_step / 60.0; // ticks/s per RPM
+
+        bool chained = ramp.lookahead > 0; // previous segment ramped into this one
+        ramp.accel = ramp_accel * tick_rpm;
+        ramp.v0 = ramp_start_rpm > 0 ? ramp_start_rpm * tick_rpm : sqrt(2 * ramp.accel);
+        if (chained)
+        {
+            retune(nsper); // continue from the current speed
+        }
+        else
+        {
+            ramp.vt = 1e9 / nsper;
+            if (ramp.v0 > ramp.vt)
+                ramp.v0 = ramp.vt;
+            ramp.len = ceil(rampLength());
+            ramp.pos = 0;
+            ramp.hold = ramp.len;
+        }
+
+        // queued segments continuing in the same direction and style are ramped along with this one
+        std::lock_guard<std::mutex> lock(queue_lock);
+        ramp.lookahead = 0;
+        for (uint32_t i = qhead; i != qtail; i++)
         {
-            uspers /= mot->microsteps;
-            steps *= mot->microsteps;
+            const StepperMotorTimerData &next = queue[i % ADAFRUIT_STEPPER_QUEUE_DEPTH];
+            if (next.dir != data.dir || next.style != data.style)
+                break;
+            ramp.lookahead += next.style == MICROSTEP && !next.raw ? next.steps * microsteps : next.steps;
+        }
+    }
+
+    double StepperMotor::rampLength() const
+    {
+        double len = ramp.vt * ramp.vt - ramp.v0 * ramp.v0;
+        // the smoothstep S-curve peaks at 3/4 of the acceleration of a straight ramp of twice its length
+        return len / (ramp_profile == RAMP_SCURVE ? ramp.accel : 2 * ramp.accel);
+    }
+
+    double StepperMotor::rampSpeed(uint32_t pos) const
+    {
+        if (pos >= ramp.len)
+            return ramp.vt;
+        double v;
+        if (ramp_profile == RAMP_SCURVE)
+        {
+            double x = (double)pos / ramp.len;
+            v = ramp.v0 + (ramp.vt - ramp.v0) * x * x * (3 - 2 * x);
+        }
+        else
+        {
+            v = sqrt(ramp.v0 * ramp.v0 + 2 * ramp.accel * pos);
+        }
+        return v > ramp.vt ? ramp.vt : v;
+    }
+
+    uint32_t StepperMotor::rampPosition(double v) const
+    {
+        // inverse of rampSpeed
+        if (v <= ramp.v0)
+            return 0;
+        if (v >= ramp.vt)
+            return ramp.len;
+        double pos;
+        if (ramp_profile == RAMP_SCURVE)
+        {
+            double y = (v - ramp.v0) / (ramp.vt - ramp.v0);
+            pos = (0.5 - sin(asin(1 - 2 * y) / 3)) * ramp.len;
+        }
+        else
+        {
+            pos = (v * v - ramp.v0 * ramp.v0) / (2 * ramp.accel);
+        }
+        pos = floor(pos + 0.5);
+        return pos > ramp.len ? ramp.len : pos;
+    }
+
+    void StepperMotor::retune(uint64_t nsper)
+    {
+        double vt = 1e9 / nsper;
+        if (vt > ramp.vt)
+        {
+            // extend the ramp to the new top speed, and continue from the current speed on it
+            double v = rampSpeed(ramp.pos);
+            ramp.vt = vt;
+            ramp.len = ceil(rampLength());
+            ramp.pos = rampPosition(v);
+            ramp.hold = ramp.len;
+        }
+        else
+        {
+            ramp.hold = rampPosition(vt);
+        }
+    }
+
+    uint64_t StepperMotor::rampPeriod(uint32_t remaining)
+    {
+        double v = rampSpeed(ramp.pos);
+        // Move along the ramp for the next tick. Deceleration starts once the ticks left after this
+        // one are no more than the ticks it took to accelerate, so the last tick is back at the start speed.
+        // Otherwise the ramp moves towards the target speed, one tick at a time.
+        if (ramp.pos >= remaining - 1)
+        {
+            if (ramp.pos)
+                ramp.pos--;
+        }
+        else if (ramp.pos < ramp.hold)
+        {
+            ramp.pos++;
+        }
+        else if (ramp.pos > ramp.hold)
+        {
+            ramp.pos--;
+        }
+        return 1e9 / v;
+    }
+
+    void StepperMotor::workerFn(StepperMotor *mot)
+    {
+        stepping_thread = true;
+        std::unique_lock<std::mutex> qlock(mot->queue_lock);
+        while (true)
+        {
+            mot->waitCommand(qlock);
+            if (mot->quit)
+                break;
+            // cs is always taken before queue_lock, e.g. by setStep() and by the worker of the other axis in runCoordinated()
+            qlock.unlock();
+            std::lock_guard<std::mutex> lock(mot->cs);
+            qlock.lock();
+            bool scheduled = false; // tick_deadline continues from the previous segment
+            mot->ramp.pos = mot->ramp.lookahead = 0; // chain starts from standstill
+            // run flushed segments back to back on the same timer
+            while (!mot->quit && mot->qhead != mot->qtail)
+            {
+                StepperMotorTimerData data = mot->queue[mot->qhead % ADAFRUIT_STEPPER_QUEUE_DEPTH];
+                uint32_t ticket = ++mot->qhead;
+                StepperMotorMoveResult &res = mot->results[ticket % ADAFRUIT_STEPPER_RESULT_DEPTH];
+                if (mot->stop_gen.load() != data.stop_gen || (data.peer != nullptr && data.peer->stop_gen.load() != data.peer_stop_gen))
+                {
+                    // queued before stopMotor()
+                    res.ticket = ticket;
+                    res.status = MOVE_CANCELLED;
+                    res.steps = 0;
+                    mot->notifyCompleted(1);
+                    continue;
+                }
+                qlock.unlock();
+                uint32_t ticks = data.style == MICROSTEP && !data.raw ? data.steps * mot->microsteps : data.steps;
+                bool ok = mot->runMove(data, scheduled);
+                if (!ok)
+                    scheduled = false;
+                if (data.peer != nullptr)
+                    data.peer->armHold(); // the other axis of a coordinated move holds as well
+                qlock.lock();
+                res.ticket = ticket;
+                res.status = !ok ? MOVE_FAILED : data.steps ? MOVE_STOPPED : MOVE_COMPLETED;
+                res.steps = ticks - data.steps; // data.steps counts the ticks left
+                mot->notifyCompleted(1);
+            }
+            struct itimerspec its;
+            memset(&its, 0x0, sizeof(its));
+            timerfd_settime(mot->timerfd, 0, &its, NULL); // disarm
+            mot->moving = false;
+            if (mot->hold_percent < 100 && mot->lastentry != nullptr)
+                mot->hold_since = monotonicNs();
+        }
+        // release any callers still waiting on queued commands
+        uint32_t dropped = mot->qtail - mot->qhead;
+        while (mot->qhead != mot->qtail)
+        {
+            uint32_t ticket = ++mot->qhead;
+            StepperMotorMoveResult &res = mot->results[ticket % ADAFRUIT_STEPPER_RESULT_DEPTH];
+            res.ticket = ticket;
+            res.status = MOVE_CANCELLED;
+            res.steps = 0;
         }
-        mot->stop = false;
-        StepperMotorTimerData data = {mot, steps, dir, style, mot->microsteps, callback_fn, callback_fn_data};
-        clkgen_t clk = create_clk(uspers * 1000LLU, stepHandlerFn, &data);
-        if (mot->cond.wait_for(lock, std::chrono::microseconds(steps * uspers)) == std::cv_status::timeout)
+        mot->notifyCompleted(dropped);
+    }
+
+    void StepperMotor::waitCommand(std::unique_lock<std::mutex> &qlock)
+    {
+        // while the coils hold at full current, also wake up to reduce the hold current
+        while (!quit && qhead == qtail)
         {
-            while (data.steps)
+            if (hold_since == 0 || hold_percent >= 100)
             {
-                usleep(uspers);
+                cond.wait(qlock);
+                continue;
             }
+            uint64_t now = monotonicNs(), deadline = hold_since + hold_delay_ms * 1000000ULL;
+            if (now < deadline)
+            {
+                cond.wait_for(qlock, std::chrono::nanoseconds(deadline - now));
+                continue;
+            }
+            uint8_t percent = hold_percent;
+            hold_since = 0;
+            qlock.unlock();
+            reduceHold(percent);
+            qlock.lock();
         }
-        destroy_clk(clk);
-        mot->moving = false;
     }
 
     /*************** Steppers **************/
     /***************************************/
 
+    /*************** MoveHandle **************/
+    /*****************************************/
+
+    MoveHandle::MoveHandle()
+    {
+        mot = nullptr;
+        ticket = 0;
+        result = MOVE_INVALID;
+        steps = 0;
+    }
+
+    MoveHandle::MoveHandle(StepperMotor *mot, uint32_t ticket)
+    {
+        this->mot = mot;
+        this->ticket = ticket;
+        result = MOVE_PENDING;
+        steps = 0;
+    }
+
+    MoveStatus MoveHandle::fetch(int64_t timeout_us) const
+    {
+        if (result == MOVE_PENDING) // results are kept once known, the motor may overwrite them later
+            result = mot->moveResult(ticket, steps, timeout_us);
+        return result;
+    }
+
+    bool MoveHandle::valid() const
+    {
+        return mot != nullptr;
+    }
+
+    bool MoveHandle::ready() const
+    {
+        return fetch(0) != MOVE_PENDING;
+    }
+
+    MoveStatus MoveHandle::status() const
+    {
+        return fetch(0);
+    }
+
+    MoveStatus MoveHandle::wait() const
+    {
+        return fetch(-1);
+    }
+
+    MoveStatus MoveHandle::waitFor(uint64_t timeout_us) const
+    {
+        return fetch(timeout_us > INT64_MAX ? -1 : (int64_t)timeout_us);
+    }
+
+    uint32_t MoveHandle::stepsExecuted() const
+    {
+        fetch(0);
+        return steps;
+    }
+
+    /*************** MoveHandle **************/
+    /*****************************************/
+
     /*************** MotorShield Private **************/
     /**************************************************/
 #ifndef _DOXYGEN_
@@ -956,6 +2246,19 @@ namespace Adafruit
 
 #define PCA9685_MODE1 0x0
 #define PCA9685_PRESCALE 0xFE
+
+#define MODE1_ALLCALL 0x01
+#define MODE1_SLEEP 0x10
+#define MODE1_AI 0x20
+#define MODE1_EXTCLK 0x40
+#define MODE1_RESTART 0x80
+
+#define PCA9685_OSC_WAKEUP_US 500 // oscillator start up time after leaving sleep mode
+
+#ifndef ADAFRUIT_MOTORSHIELD_MERGE_GAP
+// Maximum number of unchanged channels re-sent to merge two changed runs into one burst.
+#define ADAFRUIT_MOTORSHIELD_MERGE_GAP 1
+#endif
 #endif // _DOXYGEN_
 
     bool MotorShield::reset()
@@ -963,21 +2266,49 @@ namespace Adafruit
         return write8(PCA9685_MODE1, 0x0) > 0;
     }
 
-    bool MotorShield::setPWMFreq(float freq)
+    bool MotorShield::warmStart(uint16_t freq)
     {
-        dbprintlf("Attempting to set freq: %f", freq);
-        freq *=
-            0.9; // Correct for overshoot in the frequency setting (see issue #11).
-
-        float prescaleval = 25000000;
-        prescaleval /= 4096;
-        prescaleval /= freq;
-        prescaleval -= 1;
-        dbprintlf("Estimated pre-scale: %f", prescaleval);
-        uint8_t prescale = floor(prescaleval + 0.5);
-        dbprintlf("Final pre-scale: %d", prescale);
+        bool clamped;
+        uint8_t expected = calcPrescale(freq, clamped);
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        // MODE1 up to LED15_OFF_H in one burst, complete only if auto increment is already on
+        uint8_t regs[LED0_ON_L + 4 * 16];
+        uint8_t reg = PCA9685_MODE1;
+        if (!transfer(&reg, 1, regs, sizeof(regs)))
+            return false;
+        uint8_t mode = regs[PCA9685_MODE1];
+        if ((mode & (MODE1_SLEEP | MODE1_AI | MODE1_ALLCALL)) != (MODE1_AI | MODE1_ALLCALL) || !!(mode & MODE1_EXTCLK) != extclk)
+        {
+            dbprintlf("Driver not configured (MODE1 0x%02x), initializing", mode);
+            return false;
+        }
+        uint8_t check;
+        reg = PCA9685_PRESCALE;
+        if (!transfer(&reg, 1, &check, 1))
+            return false;
+        if (check != expected)
+        {
+            dbprintlf("Pre-scale %u instead of %u, initializing", check, expected);
+            return false;
+        }
+        memcpy(shadow, regs + LED0_ON_L, sizeof(shadow));
+        shadow_valid = 0xffff;
+        _freq = freq;
+        prescale = check;
+        // same state as after a full initialization: all pins off
+        uint8_t off[4];
+        encodePWM(off, 0);
+        for (int ch = 0; ch < 16; ch++)
+            if (!channelCached(ch, off))
+                return writeAll(off);
+        return true;
+    }
 
-        uint8_t oldmode;
+    bool MotorShield::configure(uint8_t prescale, bool extclk)
+    {
+        dbprintlf("Setting pre-scale %u, %s clock", prescale, extclk ? "external" : "internal");
+        std::unique_lock<MotorShieldBus> lock(*busmgr); // keep the mode change sequence together
+        uint8_t oldmode, check;
         try
         {
             oldmode = read8(PCA9685_MODE1);
@@ -987,27 +2318,44 @@ namespace Adafruit
             dbprintlf("Error reading PCA9685_MODE1: %s", e.what());
             return false;
         }
-        uint8_t newmode = (oldmode & 0x7F) | 0x10; // sleep
-        write8(PCA9685_MODE1, newmode);            // go to sleep
-        write8(PCA9685_PRESCALE, prescale);        // set the prescaler
-        write8(PCA9685_MODE1, oldmode);
-        usleep(5 * 1000);
-        write8(PCA9685_MODE1,
-               oldmode |
-                   0xa1); //  This sets the MODE1 register to turn on auto increment.
-                          // This is why the beginTransmission below was not working.
-#if (ADAFRUIT_MOTORSHIELD_DEBUG > 0)
+        uint8_t mode = oldmode & ~(MODE1_RESTART | MODE1_SLEEP);
+        if (extclk)
+            mode |= MODE1_EXTCLK;
+        // the prescaler and EXTCLK can only be written in sleep mode, EXTCLK is set in a second write while asleep
+        bool status = write8(PCA9685_MODE1, (oldmode & ~MODE1_RESTART) | MODE1_SLEEP);
+        if (extclk && !(oldmode & MODE1_EXTCLK))
+            status &= write8(PCA9685_MODE1, mode | MODE1_SLEEP);
+        status &= write8(PCA9685_PRESCALE, prescale);
+        status &= write8(PCA9685_MODE1, mode);
+        if (!extclk)
+        {
+            // other shields on the bus can use it while the oscillator starts
+            lock.unlock();
+            usleep(PCA9685_OSC_WAKEUP_US);
+            lock.lock();
+        }
+        // restart the outputs with their previous settings, turn on auto increment
+        status &= write8(PCA9685_MODE1, mode | MODE1_RESTART | MODE1_AI | MODE1_ALLCALL);
         try
         {
-            newmode = read8(PCA9685_MODE1);
+            check = read8(PCA9685_PRESCALE);
         }
         catch (const std::exception &e)
         {
-            dbprintlf("Error reading PCA9685_MODE1 after operation: %s", e.what());
+            dbprintlf("Error reading PCA9685_PRESCALE: %s", e.what());
+            return false;
         }
-        dbprintlf("Mode now: 0x%02x", newmode);
-#endif
-        return true;
+        if (check != prescale)
+        {
+            dbprintlf("Pre-scale reads back as %u instead of %u", check, prescale);
+            status = false;
+        }
+        if (status)
+        {
+            this->prescale = prescale;
+            this->extclk = extclk;
+        }
+        return status;
     }
 
     bool MotorShield::setPWM(uint8_t num, uint16_t on,
@@ -1015,50 +2363,771 @@ namespace Adafruit
     {
         dbprintlf("Setting PWM %u: 0x%04x -> 0x%04x", num, on, off);
 
-        // this is a single transaction
-        uint8_t buf[5] = {LED0_ON_L + 4 * num, on, on >> 8, off, off >> 8};
-        int counter = 10;
-        bool failed = true;
-        while (failed && counter--)
-        {
-            failed = i2cbus_write(bus, buf, sizeof(buf)) != sizeof(buf);
-        }
-        if (failed)
-        {
-            dbprintlf("Failed to write to port 0x%02x", LED0_ON_L + 4 * num);
-            return false;
-        }
-        return true;
+        uint8_t regs[4];
+        encodeChannel(regs, on, off);
+        return writeChannels(num, 1, regs);
     }
 
-    uint8_t _Catchable MotorShield::read8(uint8_t addr)
+    bool MotorShield::writeChannels(uint8_t first, uint8_t num, const uint8_t *regs, bool atomic)
     {
-        uint8_t data = 0x0;
-        int counter = 10;
-        bool failed = true;
-        while (failed && counter--)
+        if (num == 0 || first + num > 16)
         {
-            failed = i2cbus_xfer(bus, &addr, 1, &data, 1, 20) != 1;
+            dbprintlf("Invalid channel range %u + %u", first, num);
+            return false;
         }
-        if (failed)
-            throw std::runtime_error("Could not execute read/write transaction on I2C bus");
-        return data;
-    }
 
-    bool MotorShield::write8(uint8_t addr, uint8_t d)
-    {
-        int counter = 10;
-        bool failed = true;
-        uint8_t buf[2] = {addr, d};
-        while (failed && counter--)
+        std::lock_guard<MotorShieldBus> lock(*busmgr); // shadow is only valid while holding the bus
+        // Only send the channels that differ from what the chip already holds. Runs of changed
+        // channels separated by up to ADAFRUIT_MOTORSHIELD_MERGE_GAP unchanged ones are sent as
+        // one burst, since a new transaction costs more than re-sending a few unchanged bytes.
+        // An atomic write sends all changed channels in one burst, so the outputs change together
+        // on the same STOP condition.
+        if (atomic)
         {
-            failed = i2cbus_write(bus, buf, 2) != 2;
+            uint8_t start = 0, end = num;
+            while (start < num && channelCached(first + start, regs + 4 * start))
+                start++;
+            while (end > start && channelCached(first + end - 1, regs + 4 * (end - 1)))
+                end--;
+            if (start == end)
+                return true;
+            return burstWrite(first + start, end - start, regs + 4 * start);
         }
-        if (failed)
+        bool status = true;
+        uint8_t i = 0;
+        while (i < num)
+        {
+            if (channelCached(first + i, regs + 4 * i))
+            {
+                i++;
+                continue;
+            }
+            uint8_t end = i + 1, gap = 0;
+            for (uint8_t j = i + 1; j < num && gap <= ADAFRUIT_MOTORSHIELD_MERGE_GAP; j++)
+            {
+                if (channelCached(first + j, regs + 4 * j))
+                {
+                    gap++;
+                }
+                else
+                {
+                    end = j + 1;
+                    gap = 0;
+                }
+            }
+            status &= burstWrite(first + i, end - i, regs + 4 * i);
+            i = end;
+        }
+        return status;
+    }
+
+    bool MotorShield::burstWrite(uint8_t first, uint8_t num, const uint8_t *regs)
+    {
+        // this is a single transaction, relies on MODE1 auto increment set in configure
+        uint8_t buf[1 + 4 * 16];
+        buf[0] = LED0_ON_L + 4 * first;
+        memcpy(buf + 1, regs, 4 * num);
+        ssize_t len = 1 + 4 * num;
+        uint16_t mask = ((1 << num) - 1) << first;
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        if (!transfer(buf, len))
+        {
+            dbprintlf("Failed to write to port 0x%02x", buf[0]);
+            shadow_valid &= ~mask; // contents of these channels are now unknown
+            return false;
+        }
+        memcpy(shadow + 4 * first, regs, 4 * num);
+        shadow_valid |= mask;
+        return true;
+    }
+
+    bool MotorShield::writeAll(const uint8_t *regs)
+    {
+        // single transaction to ALL_LED_ON_L..ALL_LED_OFF_H, relies on MODE1 auto increment set in configure
+        uint8_t buf[1 + 4];
+        buf[0] = ALLLED_ON_L;
+        memcpy(buf + 1, regs, 4);
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        if (!transfer(buf, sizeof(buf)))
+        {
+            dbprintlf("Failed to write to port 0x%02x", buf[0]);
+            shadow_valid = 0;
+            return false;
+        }
+        for (uint8_t i = 0; i < 16; i++)
+            memcpy(shadow + 4 * i, regs, 4);
+        shadow_valid = 0xffff;
+        return true;
+    }
+
+    bool MotorShield::setAllPWM(uint16_t val)
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
             return false;
+        }
+        uint8_t regs[4];
+        encodePWM(regs, val);
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        busmgr->drain(); // queued writes must not override this one
+        return writeAll(regs);
+    }
+
+    bool MotorShield::allOff()
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
+        }
+        uint8_t regs[4];
+        encodeChannel(regs, 0, 4096); // full off, regardless of the ON time
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        busmgr->drain(); // queued writes must not turn anything back on
+        {
+            // neither must ramps
+            std::lock_guard<std::mutex> rlock(ramp_lock);
+            for (int i = 0; i < 4; i++)
+            {
+                dcmotors[i].ramping = false;
+                dcmotors[i].pwm = 0;
+            }
+            ramps_active = 0;
+        }
+        return writeAll(regs);
+    }
+
+    bool MotorShield::startRamper()
+    {
+        rampfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (rampfd < 0)
+        {
+            dbprintlf("Error %d creating ramp timer: %s", errno, strerror(errno));
+            return false;
+        }
+        ramp_quit = false;
+        ramper = std::thread(rampFn, this);
         return true;
     }
 
+    void MotorShield::stopRamper()
+    {
+        {
+            std::lock_guard<std::mutex> lock(ramp_lock);
+            if (!ramper.joinable())
+                return;
+            ramp_quit = true;
+        }
+        ramp_cond.notify_all();
+        ramper.join();
+        close(rampfd);
+        rampfd = -1;
+    }
+
+    void MotorShield::rampFn(MotorShield *shield)
+    {
+        std::unique_lock<std::mutex> lock(shield->ramp_lock);
+        while (true)
+        {
+            shield->ramp_cond.wait(lock, [shield]() { return shield->ramp_quit || shield->ramps_active; });
+            if (shield->ramp_quit)
+                break;
+            lock.unlock();
+            struct itimerspec its;
+            memset(&its, 0x0, sizeof(its));
+            its.it_value.tv_sec = ADAFRUIT_DC_RAMP_PERIOD_MS / 1000;
+            its.it_value.tv_nsec = (ADAFRUIT_DC_RAMP_PERIOD_MS % 1000) * 1000000L;
+            its.it_interval = its.it_value;
+            if (timerfd_settime(shield->rampfd, 0, &its, NULL) < 0)
+                dbprintlf("Error %d arming ramp timer: %s", errno, strerror(errno));
+            while (true)
+            {
+                uint64_t expirations;
+                if (read(shield->rampfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                {
+                    if (errno == EINTR)
+                        continue;
+                    dbprintlf("Error %d reading ramp timer: %s", errno, strerror(errno));
+                    break;
+                }
+                shield->rampTick();
+                std::lock_guard<std::mutex> rlock(shield->ramp_lock);
+                if (shield->ramp_quit || !shield->ramps_active)
+                    break;
+            }
+            memset(&its, 0x0, sizeof(its));
+            timerfd_settime(shield->rampfd, 0, &its, NULL); // disarm
+            lock.lock();
+        }
+    }
+
+    void MotorShield::rampTick()
+    {
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        busmgr->drain(); // commands queued before the tick go first
+        uint8_t regs[4 * 16];
+        memcpy(regs, shadow, sizeof(regs));
+        uint16_t mask = 0; // channels updated by the tick
+        {
+            std::lock_guard<std::mutex> rlock(ramp_lock);
+            uint64_t now = monotonicNs();
+            for (int i = 0; i < 4; i++)
+            {
+                DCMotor &m = dcmotors[i];
+                if (!m.initd || !m.ramping)
+                    continue;
+                int32_t val = m.current(now);
+                if (now - m.ramp_start >= m.ramp_len)
+                {
+                    m.ramping = false;
+                    ramps_active--;
+                }
+                MotorDir dir = val > 0 ? FORWARD : val < 0 ? BACKWARD : m.dir;
+                uint16_t pwm = val < 0 ? -val : val;
+                encodePWM(&regs[4 * m.PWMpin], pwm);
+                mask |= 1 << m.PWMpin;
+                if (dir != m.dir)
+                {
+                    encodePin(&regs[4 * m.IN1pin], dir == FORWARD);
+                    encodePin(&regs[4 * m.IN2pin], dir == BACKWARD);
+                    mask |= (1 << m.IN1pin) | (1 << m.IN2pin);
+                }
+                m.dir = dir;
+                m.pwm = pwm;
+            }
+        }
+        commitChannels(regs, mask);
+    }
+
+    bool MotorShield::applyDC(const DCCommand cmds[4], uint8_t mask)
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            if (((mask >> i) & 0x1) && cmds[i].dir != FORWARD && cmds[i].dir != BACKWARD && cmds[i].dir != RELEASE)
+            {
+                dbprintlf("Direction %u of motor %d unknown", cmds[i].dir, i + 1);
+                return false;
+            }
+        }
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        busmgr->drain(); // commands queued before these go first
+        // stage the new register contents on a copy of the shadow, the commit writes the difference
+        uint8_t regs[4 * 16];
+        memcpy(regs, shadow, sizeof(regs));
+        uint16_t channels = 0;
+        {
+            std::lock_guard<std::mutex> rlock(ramp_lock);
+            for (int i = 0; i < 4; i++)
+            {
+                DCMotor &m = dcmotors[i];
+                if (!((mask >> i) & 0x1) || !m.initd)
+                    continue;
+                uint16_t speed = cmds[i].speed > 4095 ? 4095 : cmds[i].speed;
+                encodePWM(&regs[4 * m.PWMpin], speed);
+                encodePin(&regs[4 * m.IN1pin], cmds[i].dir == FORWARD);
+                encodePin(&regs[4 * m.IN2pin], cmds[i].dir == BACKWARD);
+                channels |= (1 << m.PWMpin) | (1 << m.IN1pin) | (1 << m.IN2pin);
+                m.cancelRamp();
+                m.dir = cmds[i].dir;
+                m.pwm = speed;
+            }
+        }
+        return commitChannels(regs, channels);
+    }
+
+    bool MotorShield::applyTick(const int8_t steps[2], MotorStyle style, const int16_t pwm[4], uint8_t dc_mask)
+    {
+        // one tick of a trajectory: steppers and DC motors of the shield change in one transaction
+        busmgr->drain(); // commands queued before the tick go first
+        uint8_t regs[4 * 16];
+        memcpy(regs, shadow, sizeof(regs));
+        uint16_t channels = 0;
+        for (int i = 0; i < 2; i++)
+        {
+            StepperMotor &mot = steppers[i];
+            if (steps[i] == 0 || !mot.initd)
+                continue;
+            if (steps[i] > 1 || steps[i] < -1)
+            {
+                bprintlf("Invalid step %d of stepper %d, at most one step per tick", steps[i], i + 1);
+                return false;
+            }
+            const StepperMotorStepEntry *entry = (mot.*mot.stepKernel(style))(steps[i] > 0 ? FORWARD : BACKWARD);
+            memcpy(&regs[4 * mot.PWMApin], entry->regs, sizeof(entry->regs));
+            channels |= 0x3f << mot.PWMApin;
+        }
+        if (dc_mask)
+        {
+            std::lock_guard<std::mutex> rlock(ramp_lock);
+            for (int i = 0; i < 4; i++)
+            {
+                DCMotor &m = dcmotors[i];
+                if (!((dc_mask >> i) & 0x1) || !m.initd)
+                    continue;
+                MotorDir dir = pwm[i] > 0 ? FORWARD : pwm[i] < 0 ? BACKWARD : RELEASE;
+                uint16_t speed = pwm[i] < 0 ? -pwm[i] : pwm[i];
+                if (speed > 4095)
+                    speed = 4095;
+                encodePWM(&regs[4 * m.PWMpin], speed);
+                encodePin(&regs[4 * m.IN1pin], dir == FORWARD);
+                encodePin(&regs[4 * m.IN2pin], dir == BACKWARD);
+                channels |= (1 << m.PWMpin) | (1 << m.IN1pin) | (1 << m.IN2pin);
+                m.cancelRamp();
+                m.dir = dir;
+                m.pwm = speed;
+            }
+        }
+        return commitChannels(regs, channels);
+    }
+
+    uint32_t MotorShield::estopEpoch()
+    {
+        return estop_epoch.load();
+    }
+
+    bool MotorShield::commitChannels(const uint8_t *regs, uint16_t mask)
+    {
+        // caller holds the bus, regs holds all 16 channels, the ones in mask are written
+        if (!mask)
+            return true;
+        uint8_t first = __builtin_ctz(mask);
+        uint8_t num = 32 - __builtin_clz(mask) - first;
+        uint16_t range = ((1 << num) - 1) << first;
+        if ((shadow_valid & range) == range)
+        {
+            // one transaction from the first to the last changed channel, channels in between are resent from the shadow
+            return writeChannels(first, num, regs + 4 * first, true);
+        }
+        bool status = true;
+        for (uint8_t ch = first; ch < first + num; ch++)
+            if ((mask >> ch) & 0x1)
+                status &= writeChannels(ch, 1, regs + 4 * ch);
+        return status;
+    }
+
+    bool MotorShield::swapChannels(uint8_t first, uint8_t num, const uint8_t *expect, const uint8_t *regs)
+    {
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        for (uint8_t i = 0; i < num; i++)
+        {
+            if (!channelCached(first + i, expect + 4 * i))
+                return false; // someone else changed the channels
+        }
+        return writeChannels(first, num, regs, true);
+    }
+
+    bool MotorShield::channelCached(uint8_t ch, const uint8_t *regs) const
+    {
+        return ((shadow_valid >> ch) & 0x1) && !memcmp(shadow + 4 * ch, regs, 4);
+    }
+
+    bool MotorShield::submitChannels(uint8_t first, uint8_t num, const uint8_t *regs)
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
+        }
+        if (num == 0 || first + num > 16)
+        {
+            dbprintlf("Invalid channel range %u + %u", first, num);
+            return false;
+        }
+        if (busmgr->held())
+        {
+            // the caller owns the bus (e.g. a ShieldStack::Batch), the owner thread cannot run until it lets go:
+            // execute what is already queued to keep the order, then write directly
+            busmgr->drain();
+            return writeChannels(first, num, regs);
+        }
+        MotorShieldBusRequest req;
+        req.shield = this;
+        req.first = first;
+        req.num = num;
+        memcpy(req.regs, regs, 4 * num);
+        uint32_t pos;
+        std::lock_guard<std::mutex> lock(pending_lock);
+        if (!pending_mask && busmgr->submit(req, pos))
+        {
+            // remember the latest position for sync(), submissions from other threads may complete out of order
+            uint32_t prev = async_pos.load();
+            while ((int32_t)(pos + 1 - prev) > 0 && !async_pos.compare_exchange_weak(prev, pos + 1))
+                ;
+            return true;
+        }
+        // The queue is full: keep the latest contents of the channels for the bus owner thread, which writes them
+        // after the queue. Writes are coalesced until then, so they can not overtake the coalesced ones.
+        memcpy(pending + 4 * first, regs, 4 * num);
+        pending_mask |= ((1 << num) - 1) << first;
+        if (!pending_listed)
+        {
+            pending_listed = true;
+            busmgr->coalesce(this);
+        }
+        return true;
+    }
+
+    void MotorShield::flushCoalesced()
+    {
+        uint8_t regs[4 * 16];
+        memcpy(regs, shadow, sizeof(regs));
+        uint16_t mask;
+        {
+            std::lock_guard<std::mutex> lock(pending_lock);
+            mask = pending_mask;
+            for (uint8_t ch = 0; ch < 16; ch++)
+                if ((mask >> ch) & 0x1)
+                    memcpy(regs + 4 * ch, pending + 4 * ch, 4);
+            pending_mask = 0;
+        }
+        commitChannels(regs, mask);
+        std::lock_guard<std::mutex> lock(pending_lock);
+        if (pending_mask) // coalesced while writing
+            busmgr->coalesce(this);
+        else
+            pending_listed = false;
+    }
+
+    bool MotorShield::coalescing()
+    {
+        std::lock_guard<std::mutex> lock(pending_lock);
+        return pending_listed;
+    }
+
+    void MotorShield::sync()
+    {
+        uint32_t target = async_pos.load();
+        std::unique_lock<std::mutex> lock(busmgr->sync_lock);
+        busmgr->sync_cond.wait(lock, [this, target]() { return (int32_t)(busmgr->dequeue_pos.load() - target) >= 0 && !coalescing(); });
+    }
+
+    uint8_t _Catchable MotorShield::read8(uint8_t addr)
+    {
+        uint8_t data = 0x0;
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        if (!transfer(&addr, 1, &data, 1))
+            throw std::runtime_error("Could not execute read/write transaction on I2C bus");
+        return data;
+    }
+
+    bool MotorShield::write8(uint8_t addr, uint8_t d)
+    {
+        std::lock_guard<MotorShieldBus> lock(*busmgr);
+        uint8_t buf[2] = {addr, d};
+        return transfer(buf, 2);
+    }
+
+    bool MotorShield::transfer(const uint8_t *buf, ssize_t len, uint8_t *rbuf, ssize_t rlen)
+    {
+        // caller holds the bus
+        uint64_t start = monotonicNs();
+        uint32_t budget_us = stepping_thread ? retry.step_budget_us : retry.budget_us;
+        uint32_t max_attempts = failing && retry.fail_fast ? 1 : retry.max_attempts;
+        uint32_t backoff_us = retry.backoff_us;
+        uint32_t attempts = 0;
+        bool failed = true;
+        while (true)
+        {
+            int ret;
+            if (rbuf == nullptr)
+                ret = i2c->write(bus, buf, len);
+            else
+                ret = i2c->xfer(bus, (void *)buf, len, rbuf, rlen, 20);
+            attempts++;
+            failed = ret != (rbuf == nullptr ? len : rlen);
+            if (!failed)
+                break;
+            int err = ret < 0 ? errno : EIO; // short transfer
+            bool retryable = true;
+            if (err == EAGAIN || err == EBUSY)
+            {
+                err_busy.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (err == ETIMEDOUT)
+            {
+                err_timeouts.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (err == EREMOTEIO || err == ENXIO)
+            {
+                err_naks.fetch_add(1, std::memory_order_relaxed);
+                retryable = attempts < retry.nak_attempts;
+            }
+            else
+            {
+                err_other.fetch_add(1, std::memory_order_relaxed);
+                retryable = err == EIO || err == EINTR;
+            }
+            if (!retryable || attempts >= max_attempts)
+                break;
+            uint32_t wait_us = err == EINTR ? 0 : backoff_us;
+            if (budget_us && (monotonicNs() - start) / 1000 + wait_us >= budget_us)
+            {
+                err_budget.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            if (wait_us)
+                usleep(wait_us);
+            backoff_us = backoff_us * 2 > retry.max_backoff_us ? retry.max_backoff_us : backoff_us * 2;
+            err_retries.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (failed)
+            err_failures.fetch_add(1, std::memory_order_relaxed);
+        failing = failed;
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        statsRecord(stat_latency, monotonicNs() - start);
+        stat_transactions.fetch_add(1, std::memory_order_relaxed);
+        stat_retries.fetch_add(attempts - 1, std::memory_order_relaxed);
+        if (failed)
+            stat_failures.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return !failed;
+    }
+
     /*************** MotorShield Private **************/
     /**************************************************/
+
+    /*************** MotorShieldBus **************/
+    /*********************************************/
+
+#ifndef _DOXYGEN_
+    static MotorShieldBus shield_buses[ADAFRUIT_MAX_I2C_BUSES];
+    static std::mutex shield_buses_lock;
+#endif
+
+    MotorShieldBus::MotorShieldBus()
+    {
+        next_ticket = serving = 0;
+        depth = 0;
+        busnum = -1;
+        refs = 0;
+        for (uint32_t i = 0; i < ADAFRUIT_BUS_QUEUE_DEPTH; i++)
+            cells[i].seq = i;
+        enqueue_pos = dequeue_pos = 0;
+        coalesced = nullptr;
+        sleeping = false;
+        quit = false;
+        wakefd = -1;
+    }
+
+    MotorShieldBus *MotorShieldBus::get(int bus)
+    {
+        std::lock_guard<std::mutex> lock(shield_buses_lock);
+        MotorShieldBus *unused = nullptr;
+        for (int i = 0; i < ADAFRUIT_MAX_I2C_BUSES; i++)
+        {
+            if (shield_buses[i].refs && shield_buses[i].busnum == bus)
+            {
+                shield_buses[i].refs++;
+                return &shield_buses[i];
+            }
+            if (!shield_buses[i].refs && unused == nullptr)
+                unused = &shield_buses[i];
+        }
+        if (unused != nullptr)
+        {
+            if (!unused->start())
+                return nullptr;
+            unused->busnum = bus;
+            unused->refs = 1;
+        }
+        return unused;
+    }
+
+    void MotorShieldBus::put(MotorShieldBus *bus)
+    {
+        std::lock_guard<std::mutex> lock(shield_buses_lock);
+        if (bus != nullptr && bus->refs > 0 && --bus->refs == 0)
+            bus->stop();
+    }
+
+    bool MotorShieldBus::start()
+    {
+        wakefd = eventfd(0, EFD_CLOEXEC);
+        if (wakefd < 0)
+        {
+            dbprintlf("Error %d creating bus wakeup event: %s", errno, strerror(errno));
+            return false;
+        }
+        quit = false;
+        ownerthread = std::thread(ownerFn, this);
+        return true;
+    }
+
+    void MotorShieldBus::stop()
+    {
+        quit = true;
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) < 0)
+            dbprintlf("Error %d waking up bus owner: %s", errno, strerror(errno));
+        ownerthread.join();
+        close(wakefd);
+        wakefd = -1;
+    }
+
+    bool MotorShieldBus::submit(const MotorShieldBusRequest &req, uint32_t &pos)
+    {
+        // bounded MPMC queue (D. Vyukov), lock-free for producers
+        Cell *cell;
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells[pos & (ADAFRUIT_BUS_QUEUE_DEPTH - 1)];
+            int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->req = req;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    void MotorShieldBus::coalesce(MotorShield *shield)
+    {
+        // lock-free stack, the owner takes all of it at once
+        MotorShield *head = coalesced.load(std::memory_order_relaxed);
+        do
+            shield->pending_next = head;
+        while (!coalesced.compare_exchange_weak(head, shield));
+        wake();
+    }
+
+    void MotorShieldBus::wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in ownerFn
+        if (sleeping.load(std::memory_order_relaxed))
+        {
+            uint64_t one = 1;
+            if (write(wakefd, &one, sizeof(one)) < 0)
+                dbprintlf("Error %d waking up bus owner: %s", errno, strerror(errno));
+        }
+    }
+
+    bool MotorShieldBus::runOne()
+    {
+        // consumers are serialized by the bus lock, so the pop does not need a CAS
+        uint32_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Cell *cell = &cells[pos & (ADAFRUIT_BUS_QUEUE_DEPTH - 1)];
+        if (cell->seq.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        MotorShieldBusRequest req = cell->req;
+        cell->seq.store(pos + ADAFRUIT_BUS_QUEUE_DEPTH, std::memory_order_release);
+        req.shield->writeChannels(req.first, req.num, req.regs);
+        dequeue_pos.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool MotorShieldBus::runCoalesced()
+    {
+        // coalesced writes are newer than every queued one, they wait until the queue is empty
+        if (coalesced.load() == nullptr || enqueue_pos.load() != dequeue_pos.load(std::memory_order_relaxed))
+            return false;
+        MotorShield *shield = coalesced.exchange(nullptr);
+        while (shield != nullptr)
+        {
+            MotorShield *next = shield->pending_next; // the shield may be listed again while it is written
+            shield->flushCoalesced();
+            shield = next;
+        }
+        return true;
+    }
+
+    void MotorShieldBus::drain()
+    {
+        // a queued write that is still being stored by another thread is waited for if coalesced writes follow it
+        while (runOne() || runCoalesced() || (coalesced.load() != nullptr && enqueue_pos.load() != dequeue_pos.load()))
+            ;
+    }
+
+    bool MotorShieldBus::setRealtime(int priority, int cpu)
+    {
+        std::lock_guard<std::mutex> lock(shield_buses_lock);
+        if (!ownerthread.joinable())
+            return false;
+        return setThreadRealtime(ownerthread, priority, cpu, "I2C bus");
+    }
+
+    bool MotorShieldBus::held()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        return depth && owner == std::this_thread::get_id();
+    }
+
+    void MotorShieldBus::ownerFn(MotorShieldBus *bus)
+    {
+        while (!bus->quit)
+        {
+            bool ran;
+            {
+                std::lock_guard<MotorShieldBus> lock(*bus);
+                ran = bus->runOne() || bus->runCoalesced();
+            }
+            if (ran)
+                continue;
+            // queue drained
+            {
+                std::lock_guard<std::mutex> lock(bus->sync_lock);
+            }
+            bus->sync_cond.notify_all();
+            bus->sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in submit
+            uint32_t pos = bus->dequeue_pos.load(std::memory_order_relaxed);
+            if (bus->cells[pos & (ADAFRUIT_BUS_QUEUE_DEPTH - 1)].seq.load(std::memory_order_acquire) != pos + 1 && bus->coalesced.load() == nullptr && !bus->quit)
+            {
+                uint64_t val;
+                if (read(bus->wakefd, &val, sizeof(val)) < 0 && errno != EINTR)
+                    dbprintlf("Error %d waiting for bus requests: %s", errno, strerror(errno));
+            }
+            bus->sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void MotorShieldBus::lock()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if (depth && owner == std::this_thread::get_id())
+        {
+            depth++;
+            return;
+        }
+        uint32_t ticket = next_ticket++;
+        cv.wait(lock, [this, ticket]() { return serving == ticket; });
+        owner = std::this_thread::get_id();
+        depth = 1;
+    }
+
+    void MotorShieldBus::unlock()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (--depth)
+            return;
+        owner = std::thread::id();
+        serving++;
+        cv.notify_all();
+    }
+
+    int MotorShieldBus::id() const
+    {
+        return busnum;
+    }
+
+    /*************** MotorShieldBus **************/
+    /*********************************************/
 }
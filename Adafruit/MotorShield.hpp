@@ -37,10 +37,11 @@
 #include <unistd.h>
 #include <stdint.h>
 #include "i2cbus/i2cbus.h"
-#include "clkgen.h"
 
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <atomic>
 
 namespace Adafruit
 {
@@ -80,6 +81,119 @@ namespace Adafruit
 #define ADAFRUIT_ENABLE_SIGPIPE
 #endif
 
+#if !defined(ADAFRUIT_MAX_I2C_BUSES)
+/**
+ * @brief Maximum number of I2C buses with motor shields in use at the same time.
+ *
+ */
+#define ADAFRUIT_MAX_I2C_BUSES 8
+#endif
+
+#if !defined(ADAFRUIT_MAX_SHIELDS)
+/**
+ * @brief Maximum number of initialized motor shields that are stopped by {@link Adafruit::MotorShield::emergencyStop}.
+ *
+ */
+#define ADAFRUIT_MAX_SHIELDS 64
+#endif
+
+#if !defined(ADAFRUIT_ESTOP_WAIT_MS)
+/**
+ * @brief Time {@link Adafruit::MotorShield::emergencyStop} waits for the motors to be turned off, in ms.
+ *
+ */
+#define ADAFRUIT_ESTOP_WAIT_MS 100
+#endif
+
+#if !defined(ADAFRUIT_BUS_QUEUE_DEPTH)
+/**
+ * @brief Number of asynchronous register writes that can be pending on an I2C bus, has to be a power of 2.
+ * Writes submitted while the queue is full are coalesced per channel instead of waiting for a free slot.
+ *
+ */
+#define ADAFRUIT_BUS_QUEUE_DEPTH 64
+#endif
+
+#if !defined(ADAFRUIT_STEPPER_QUEUE_DEPTH)
+/**
+ * @brief Number of stepping commands that can be queued on a stepper motor
+ * before {@link Adafruit::StepperMotor::step} waits for a free slot.
+ *
+ */
+#define ADAFRUIT_STEPPER_QUEUE_DEPTH 16
+#endif
+
+#if !defined(ADAFRUIT_STEPPER_RESULT_DEPTH)
+/**
+ * @brief Number of completed moves per stepper motor whose results are kept for {@link Adafruit::MoveHandle}.
+ *
+ */
+#define ADAFRUIT_STEPPER_RESULT_DEPTH 64
+#endif
+
+#if !defined(ADAFRUIT_PCA9685_OSC_HZ)
+/**
+ * @brief Default oscillator frequency of the PWM driver in Hz, see {@link Adafruit::MotorShield::setOscillatorFrequency}.
+ * The internal oscillator is nominally 25 MHz, the default includes the 0.9 frequency correction applied by
+ * earlier versions of the library (see issue #11), which gives the same prescale values.
+ *
+ */
+#define ADAFRUIT_PCA9685_OSC_HZ 27777778
+#endif
+
+#if !defined(ADAFRUIT_DC_RAMP_PERIOD_MS)
+/**
+ * @brief Update period of DC motor ramps in milliseconds, see {@link Adafruit::DCMotor::rampTo}.
+ *
+ */
+#define ADAFRUIT_DC_RAMP_PERIOD_MS 10
+#endif
+
+#if !defined(ADAFRUIT_STEPPER_CALLBACK_DEPTH)
+/**
+ * @brief Number of step callbacks per stepper motor that can wait for the callback thread, has to be a power of 2.
+ * Callbacks are dropped while the queue is full, see {@link Adafruit::StepperMotor::getDroppedCallbacks}.
+ *
+ */
+#define ADAFRUIT_STEPPER_CALLBACK_DEPTH 256
+#endif
+
+#if !defined(ADAFRUIT_STEPPER_MAX_CATCHUP)
+/**
+ * @brief Number of step periods a stepper motor may fall behind its schedule, e.g. because of a slow I2C bus or callback,
+ * and then catch up by taking the late (micro)steps back to back. A motor that falls further behind restarts its schedule
+ * from the current time, which lengthens the move, and counts an overrun (see {@link Adafruit::StepperMotor::getOverruns}).
+ *
+ */
+#define ADAFRUIT_STEPPER_MAX_CATCHUP 2
+#endif
+
+#if !defined(ADAFRUIT_STEPPER_HOLD_DELAY_MS)
+/**
+ * @brief Default idle time of a stepper motor before its hold current is reduced, in milliseconds,
+ * see {@link Adafruit::StepperMotor::setHoldCurrent}.
+ *
+ */
+#define ADAFRUIT_STEPPER_HOLD_DELAY_MS 500
+#endif
+
+#if !defined(ADAFRUIT_MOTORSHIELD_STATS)
+/**
+ * @brief Enable collection of I2C transaction and step timing statistics, see {@link Adafruit::MotorShield::getStats} and
+ * {@link Adafruit::StepperMotor::getStats}. Disabled by default, which compiles out all collection.
+ * Changes the layout of the library classes, so it has to be set identically for the library and the application,
+ * e.g. `make CXXFLAGS=-DADAFRUIT_MOTORSHIELD_STATS=1`.
+ *
+ */
+#define ADAFRUIT_MOTORSHIELD_STATS 0
+#endif
+
+/**
+ * @brief Number of buckets of a {@link Adafruit::LatencyHistogram}.
+ *
+ */
+#define ADAFRUIT_STATS_BUCKETS 16
+
 /**
  * @brief Indicates the function throws exceptions
  * 
@@ -147,7 +261,127 @@ namespace Adafruit
         STEP512 = 512  /*!< 512 microsteps per step, max speed 0.15625 RPM. */
     } MicroSteps;
 
+    /**
+     * @brief Defines the speed profile used to start and stop a stepper motor.
+     *
+     */
+    typedef enum : uint8_t
+    {
+        RAMP_NONE = 0,        /*!< Step at the set speed from the first step, default. */
+        RAMP_TRAPEZOIDAL = 1, /*!< Constant acceleration to the set speed, constant deceleration to stop. */
+        RAMP_SCURVE = 2       /*!< Smooth acceleration that starts and ends at zero, for loads sensitive to jerk. */
+    } RampProfile;
+
+    /**
+     * @brief Defines the state of a move tracked by a {@link Adafruit::MoveHandle}.
+     *
+     */
+    typedef enum : uint8_t
+    {
+        MOVE_INVALID = 0,   /*!< The handle does not refer to a move. */
+        MOVE_PENDING = 1,   /*!< The move is queued or in progress. */
+        MOVE_COMPLETED = 2, /*!< All steps of the move were executed. */
+        MOVE_STOPPED = 3,   /*!< The move was stopped early using {@link Adafruit::StepperMotor::stopMotor} or by a signal. */
+        MOVE_FAILED = 4,    /*!< The move was aborted because the step timer failed. */
+        MOVE_CANCELLED = 5, /*!< The move was dropped before it started, by {@link Adafruit::StepperMotor::stopMotor}, a signal or because the motor was released. */
+        MOVE_EXPIRED = 6    /*!< The move completed, but its result was overwritten by {@link ADAFRUIT_STEPPER_RESULT_DEPTH} later moves. */
+    } MoveStatus;
+
+    /**
+     * @brief Histogram of durations with power of 2 buckets: bucket 0 counts durations below 1 us, bucket n
+     * counts durations from 2^(n - 1) us up to 2^n us, and the last bucket also counts all longer durations.
+     *
+     */
+    struct LatencyHistogram
+    {
+        uint32_t count[ADAFRUIT_STATS_BUCKETS]; ///< Number of samples per bucket
+        uint64_t total_ns;                      ///< Sum of all samples, in nanoseconds
+        uint32_t max_ns;                        ///< Longest sample, in nanoseconds
+    };
+
+    /**
+     * @brief I2C statistics of a {@link Adafruit::MotorShield}, collected if {@link ADAFRUIT_MOTORSHIELD_STATS} is enabled.
+     *
+     */
+    struct MotorShieldStats
+    {
+        LatencyHistogram latency; ///< Duration of I2C transactions, including retries
+        uint32_t transactions;    ///< Number of I2C transactions
+        uint32_t retries;         ///< Number of repeated attempts of failed transactions
+        uint32_t failures;        ///< Number of transactions given up after all attempts failed
+    };
+
+    /**
+     * @brief New state of a DC motor, see {@link Adafruit::MotorShield::applyDC}.
+     *
+     */
+    struct DCCommand
+    {
+        MotorDir dir;   ///< FORWARD, BACKWARD or RELEASE
+        uint16_t speed; ///< PWM duty cycle, 0-4095
+    };
+
+    /**
+     * @brief Retry policy for failed I2C transactions of a {@link Adafruit::MotorShield}, see {@link Adafruit::MotorShield::setRetryPolicy}.
+     * Failures are classified by errno: EAGAIN and EBUSY (bus busy, lost arbitration), ETIMEDOUT and EIO are retried with
+     * exponential backoff, a NAK (EREMOTEIO, ENXIO) from a missing or browned-out shield is retried at most nak_attempts times,
+     * other errors are not retried. The bus stays held between attempts.
+     *
+     */
+    struct RetryPolicy
+    {
+        uint8_t max_attempts = 10;       ///< Attempts per transaction, including the first one, at least 1
+        uint8_t nak_attempts = 2;        ///< Attempts per transaction while the shield does not acknowledge
+        uint32_t backoff_us = 20;        ///< Wait before the first retry, doubled for every further retry, 0 to retry immediately
+        uint32_t max_backoff_us = 1000;  ///< Upper limit of the wait between attempts
+        uint32_t budget_us = 0;          ///< Time limit for all attempts of a transaction, 0 for no limit
+        uint32_t step_budget_us = 500;   ///< Time limit for all attempts of a transaction issued by a stepping thread, 0 for no limit
+        bool fail_fast = true;           ///< After a transaction failed, attempt following transactions once until one succeeds
+    };
+
+    /**
+     * @brief I2C error counts of a {@link Adafruit::MotorShield}, always collected, see {@link Adafruit::MotorShield::getErrorCounts}.
+     *
+     */
+    struct I2CErrorCounts
+    {
+        uint32_t busy;     ///< Failed attempts with EAGAIN or EBUSY
+        uint32_t timeouts; ///< Failed attempts with ETIMEDOUT
+        uint32_t naks;     ///< Failed attempts with EREMOTEIO or ENXIO
+        uint32_t other;    ///< Failed attempts with any other error
+        uint32_t retries;  ///< Repeated attempts
+        uint32_t failures; ///< Transactions given up
+        uint32_t budget_exceeded; ///< Transactions given up because the time limit ran out
+    };
+
+    /**
+     * @brief Step timing statistics of a {@link Adafruit::StepperMotor}, collected if {@link ADAFRUIT_MOTORSHIELD_STATS} is enabled.
+     *
+     */
+    struct StepperMotorStats
+    {
+        LatencyHistogram lateness; ///< Time between the nominal time of a (micro)step and the wake up of the stepping thread
+        uint32_t ticks;            ///< Number of (micro)steps taken by the stepping thread
+        uint32_t missed;           ///< Number of step periods that expired while a (micro)step was waiting to be taken
+    };
+
+    /**
+     * @brief I2C backend used by {@link Adafruit::MotorShield} to access the PWM driver, see {@link Adafruit::MotorShield::setI2CBackend}.
+     * By default the shields use the i2cbus library. A replacement backend, e.g. a mock for testing and benchmarking without
+     * hardware, receives the i2cbus object of the shield as a handle and does not have to use its contents.
+     *
+     */
+    struct I2CBackend
+    {
+        int (*open)(i2cbus *dev, int id, int addr);              ///< Open device at address addr on bus id, returns negative on error
+        int (*write)(i2cbus *dev, const void *buf, ssize_t len); ///< Write len bytes in one transaction, returns the number of bytes written
+        int (*xfer)(i2cbus *dev, void *out, ssize_t outlen, void *in, ssize_t inlen, unsigned long timeout_usec); ///< Write outlen bytes then read inlen bytes, returns the number of bytes read
+        int (*close)(i2cbus *dev);                               ///< Close the device
+    };
+
     class MotorShield;
+    class TrajectoryPlayer;
+    class ShieldServer;
 
     /**
      * @brief Object that controls and keeps state for a single DC motor.
@@ -167,6 +401,9 @@ namespace Adafruit
 
         /**
          * @brief Control the DC Motor direction and action.
+         * DC motor commands are submitted to the bus owner thread and return without waiting for
+         * the I2C transaction, use {@link Adafruit::MotorShield::sync} to wait for them to be written.
+         * Both direction pins are updated in a single transaction.
          *
          * @param cmd The action to perform, can be FORWARD, BACKWARD or RELEASE.
          */
@@ -198,10 +435,37 @@ namespace Adafruit
          */
         void fullOn(void);
 
+        /**
+         * @brief Ramp the motor linearly from its current speed and direction to a new one, e.g. for a soft start.
+         * The ramps of all motors of a shield are run by one thread of the shield, started by {@link Adafruit::MotorShield::getMotor}, which updates the speed every
+         * {@link ADAFRUIT_DC_RAMP_PERIOD_MS} milliseconds and writes all motors of the shield in a single I2C transaction.
+         * The direction pins change when the ramp passes through zero. Other commands for the motor cancel the ramp.
+         *
+         * @param speed Target 12-bit PWM value, -4095 (full on BACKWARD) to 4095 (full on FORWARD).
+         * @param duration_ms Duration of the ramp in milliseconds, 0 sets the speed immediately.
+         * @return bool true on success, false if the motor was not initialized or the ramp thread could not be started.
+         */
+        bool rampTo(int16_t speed, uint32_t duration_ms);
+
+        /**
+         * @brief Check if a ramp started using {@link Adafruit::DCMotor::rampTo} is in progress.
+         *
+         * @return bool true if the motor is ramping.
+         */
+        bool isRamping() const;
+
     private:
         uint8_t PWMpin, IN1pin, IN2pin;
         MotorShield *MC;
         bool initd;
+        // protected by the ramp_lock of the shield
+        MotorDir dir;       // last direction written
+        uint16_t pwm;       // last PWM value written
+        bool ramping;
+        int16_t ramp_from, ramp_to; // signed PWM values, negative is BACKWARD
+        uint64_t ramp_start, ramp_len; // CLOCK_MONOTONIC, ns
+        int32_t current(uint64_t now) const;
+        void cancelRamp();
     };
 
 #ifndef _DOXYGEN_
@@ -218,21 +482,132 @@ namespace Adafruit
     typedef void (*StepperMotorCB_t)(StepperMotor *mot, void *user_data);
 
 #ifndef _DOXYGEN_
+    struct StepperMotorRamp
+    {
+        double v0;    // start/end speed, ticks/s
+        double vt;    // speed at the top of the ramp, ticks/s
+        double accel; // ticks/s^2
+        uint32_t len; // ramp length in ticks
+        uint32_t pos; // current position along the ramp, in ticks
+        uint32_t hold; // position of the target speed, <= len when the speed was lowered during a move
+        uint32_t lookahead; // ticks of the following segments ramped along with the current one
+    };
+
     struct StepperMotorTimerData
     {
-        StepperMotor *_this;
-        uint16_t steps;
+        uint32_t steps;
+        bool raw; // MICROSTEP steps already counted in microsteps
         MotorDir dir;
         MotorStyle style;
         MicroSteps msteps;
         StepperMotorCB_t callback_fn;
         void *callback_user_data;
+        StepperMotor *peer; // second axis of a coordinated move, nullptr otherwise
+        uint32_t peer_steps;
+        MotorDir peer_dir;
+        uint32_t stop_gen;      // stop generation of the motor when the move was queued
+        uint32_t peer_stop_gen; // stop generation of the second axis when the move was queued
+        uint32_t estop_halts;   // emergency stops that had stopped the steppers when the move was queued
     };
 
-    struct StepperMotorDestroyClkData
+    struct StatsHistogram
     {
-        StepperMotor *_this;
-        clkgen_t clk;
+        std::atomic<uint32_t> count[ADAFRUIT_STATS_BUCKETS];
+        std::atomic<uint64_t> total_ns;
+        std::atomic<uint32_t> max_ns;
+    };
+
+    struct StepperMotorMoveResult
+    {
+        uint32_t ticket;    // move this result belongs to
+        MoveStatus status;
+        uint32_t steps;     // (micro)steps executed
+    };
+
+    struct StepperMotorNotification
+    {
+        StepperMotorCB_t callback_fn;
+        void *callback_user_data;
+    };
+#endif
+
+    /**
+     * @brief Handle to a move queued using {@link Adafruit::StepperMotor::stepAsync}, to wait for the move and
+     * retrieve its result. Handles are small values that can be copied freely, and stay usable as long as the
+     * stepper motor exists.
+     *
+     */
+    class MoveHandle
+    {
+    public:
+        /**
+         * @brief Create a handle that does not refer to a move.
+         *
+         */
+        MoveHandle();
+
+        /**
+         * @brief Check if the handle refers to a move.
+         *
+         * @return bool
+         */
+        bool valid() const;
+
+        /**
+         * @brief Check if the move is done, without blocking.
+         *
+         * @return bool true if the move is no longer pending.
+         */
+        bool ready() const;
+
+        /**
+         * @brief Get the state of the move, without blocking.
+         *
+         * @return MoveStatus
+         */
+        MoveStatus status() const;
+
+        /**
+         * @brief Block until the move is done.
+         *
+         * @return MoveStatus Final state of the move, MOVE_INVALID for an invalid handle.
+         */
+        MoveStatus wait() const;
+
+        /**
+         * @brief Block until the move is done, or the timeout expires.
+         *
+         * @param timeout_us Timeout in microseconds.
+         * @return MoveStatus Final state of the move, MOVE_PENDING if the timeout expired.
+         */
+        MoveStatus waitFor(uint64_t timeout_us) const;
+
+        /**
+         * @brief Get the number of steps the move executed, counted in microsteps for MICROSTEP moves.
+         *
+         * @return uint32_t Steps executed, 0 if the move is pending or its result is not available.
+         */
+        uint32_t stepsExecuted() const;
+
+    private:
+        MoveHandle(StepperMotor *mot, uint32_t ticket);
+        MoveStatus fetch(int64_t timeout_us) const;
+
+        StepperMotor *mot;
+        uint32_t ticket;
+        mutable MoveStatus result;
+        mutable uint32_t steps;
+
+        friend class StepperMotor; ///< Let StepperMotor create MoveHandles
+    };
+
+#ifndef _DOXYGEN_
+    struct StepperMotorStepEntry
+    {
+        uint16_t pwma;      // PWM A output
+        uint16_t pwmb;      // PWM B output
+        uint8_t latch;      // coil energization bits (AIN2, BIN1, AIN1, BIN2)
+        uint8_t regs[4 * 6]; // LEDn register burst for PWMA, AIN2, AIN1, BIN1, BIN2, PWMB
     };
 #endif
 
@@ -243,8 +618,40 @@ namespace Adafruit
     class StepperMotor
     {
     private:
-        static void stepHandlerFn(clkgen_t clk, void *data_);
-        static void stepThreadFn(StepperMotor *mot, uint16_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data);
+        static void workerFn(StepperMotor *mot);
+        typedef const StepperMotorStepEntry *(StepperMotor::*StepKernel)(MotorDir dir);
+        template <MotorStyle S, MicroSteps M>
+        const StepperMotorStepEntry *stepT(MotorDir dir); // advances one tick of style S at M microsteps
+        StepKernel stepKernel(MotorStyle style) const;    // stepT for style and the current microsteps
+        bool stepHandlerFn(StepperMotorTimerData &data, StepKernel kernel);
+        bool runMove(StepperMotorTimerData &data, bool &scheduled);
+        bool runCoordinated(StepperMotorTimerData &data, bool &scheduled);
+        bool waitTick(uint64_t ns);
+        const StepperMotorStepEntry *nextStep(MotorDir dir, MotorStyle style);
+        void startRamp(const StepperMotorTimerData &data, uint64_t nsper);
+        void retune(uint64_t nsper);
+        uint64_t rampPeriod(uint32_t remaining);
+        double rampSpeed(uint32_t pos) const;
+        uint32_t rampPosition(double v) const;
+        double rampLength() const;
+        uint64_t tickPeriod(MotorStyle style);
+        StepperMotorTimerData &pushCommand(uint32_t steps, MotorDir dir, MotorStyle style, StepperMotorCB_t callback_fn, void *callback_fn_data, bool raw = false);
+        uint32_t publish(std::unique_lock<std::mutex> &lock, bool blocking); // returns the ticket of the last move
+        bool startWorker();
+        void stopWorker();
+        void notifyCompleted(uint32_t count); // call with queue_lock held
+        void notifyStep(const StepperMotorTimerData &data);
+        void waitCallbacks();
+        static void dispatcherFn(StepperMotor *mot);
+        void waitCommand(std::unique_lock<std::mutex> &qlock); // call with queue_lock held
+        void armHold();
+        void reduceHold(uint8_t percent);
+        MoveStatus moveResult(uint32_t ticket, uint32_t &steps, int64_t timeout_us); // timeout_us < 0 waits forever
+        bool stepsValid(uint32_t steps, MotorStyle style) const;
+        const char *moveError(uint32_t steps, MotorStyle style) const; // nullptr if the move can be queued
+        uint32_t queueMove(uint32_t steps, MotorDir dir, MotorStyle style, bool blocking, StepperMotorCB_t callback_fn, void *callback_fn_data); // returns the ticket
+        int64_t stepDistance(uint32_t steps, MotorStyle style) const;
+        void plan(uint32_t ticks, MotorDir dir, MotorStyle style); // call with queue_lock held
 
     protected:
         /**
@@ -253,17 +660,41 @@ namespace Adafruit
          */
         StepperMotor(void);
 
+        /**
+         * @brief Stop the stepping worker of the motor.
+         *
+         */
+        ~StepperMotor();
+
     public:
         /**
          * @brief Set the delay for the Stepper Motor speed in RPM.
-         * Throws exception in case rpm <= 0.
+         * Throws exception in case rpm <= 0. The speed can be changed while the motor is moving: the running move
+         * switches to the new speed on its next step, without stopping. With an acceleration profile set using
+         * {@link Adafruit::StepperMotor::setRamp} the motor accelerates or decelerates to the new speed at the
+         * acceleration of the profile, and does not go below the start speed of the profile.
          *
          * @param rpm The desired RPM, it is not guaranteed to be achieved. In double coil mode upto ~68 RPM is achieved for a 200 steps/rev stepper, in microstep mode ~1.25 RPM is achieved for a 200 steps/rev stepper at STEP64 setting, ~0.3125 RPM at STEP256 setting.
          *
-         * @return bool true on success, false on failure.
+         * @return bool true on success.
          */
         bool _Catchable setSpeed(double rpm);
 
+        /**
+         * @brief Set the acceleration profile used by {@link Adafruit::StepperMotor::step} and queued segments.
+         * The motor accelerates from the start speed to the speed set using {@link Adafruit::StepperMotor::setSpeed},
+         * and decelerates so that it is back at the start speed on the last step of the move. Consecutive flushed
+         * segments in the same direction and stepping style are ramped as one move. The step period is updated
+         * on every step, no profile is precomputed. Stopping the motor using {@link Adafruit::StepperMotor::stopMotor}
+         * is immediate and does not decelerate.
+         *
+         * @param profile RAMP_NONE, RAMP_TRAPEZOIDAL or RAMP_SCURVE.
+         * @param accel Acceleration in RPM per second, must be positive unless profile is RAMP_NONE. For RAMP_SCURVE, this is the peak acceleration.
+         * @param start_rpm Optional speed at the start and the end of a move in RPM. By default the motor starts at the speed reached after one step under the given acceleration.
+         * @return bool true on success, false on invalid arguments or if the motor is moving.
+         */
+        bool setRamp(RampProfile profile, double accel = 0, double start_rpm = 0);
+
         /**
          * @brief Move the stepper motor with the given RPM speed,
          * at the speed set using {@link Adafruit::StepperMotor::setSpeed}. Throws exception if RPM was not set prior to call.
@@ -272,10 +703,89 @@ namespace Adafruit
          * @param dir The direction of movement, can be FORWARD or BACKWARD.
          * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
          * @param blocking Whether the step function blocks until stepping is complete. Set to true by default.
-         * @param callback_fn Optional callback function of type {@link StepperMotorCB_t} to be executed after each (micro)step. Note: The execution of the callback function removes the guarantee of the motor spinning at the speed set using {@link Adafruit::StepperMotor::setSpeed}.
+         * A non-blocking call queues the move on the stepping worker of the motor and returns immediately; moves
+         * are executed in the order they are issued. If {@link ADAFRUIT_STEPPER_QUEUE_DEPTH} moves are already queued,
+         * the call waits for a free slot.
+         * @param callback_fn Optional callback function of type {@link StepperMotorCB_t} to be executed after each (micro)step, see {@link Adafruit::StepperMotor::setCallbackRate}. The callback runs on a separate thread of the motor and does not delay the steps. A blocking call returns after the motor stopped and all its callbacks have run.
+         * @param callback_fn_data Optional data to be passed to the callback function.
+         */
+        void _Catchable step(uint32_t steps, MotorDir dir, MotorStyle style = SINGLE, bool blocking = true, StepperMotorCB_t _Nullable callback_fn = NULL, void * _Nullable callback_fn_data = NULL);
+
+        /**
+         * @brief Queue a move like a non-blocking {@link Adafruit::StepperMotor::step}, and return a handle to wait
+         * for the move and retrieve the number of steps executed and how it ended. Throws exception if RPM was not set prior to call.
+         *
+         * @param steps Number of steps to move.
+         * @param dir The direction of movement, can be FORWARD or BACKWARD.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
+         * @param callback_fn Optional callback function of type {@link StepperMotorCB_t} to be executed after each (micro)step.
+         * @param callback_fn_data Optional data to be passed to the callback function.
+         * @return MoveHandle Handle to the queued move.
+         */
+        MoveHandle _Catchable stepAsync(uint32_t steps, MotorDir dir, MotorStyle style = SINGLE, StepperMotorCB_t _Nullable callback_fn = NULL, void * _Nullable callback_fn_data = NULL);
+
+        /**
+         * @brief Queue a move like {@link Adafruit::StepperMotor::stepAsync}, reporting errors as a return value
+         * instead of an exception. Waits for a free slot if {@link ADAFRUIT_STEPPER_QUEUE_DEPTH} moves are already queued.
+         *
+         * @param handle Set to the handle of the queued move, left unchanged on error.
+         * @param steps Number of steps to move.
+         * @param dir The direction of movement, can be FORWARD or BACKWARD.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
+         * @param callback_fn Optional callback function of type {@link StepperMotorCB_t} to be executed after each (micro)step.
          * @param callback_fn_data Optional data to be passed to the callback function.
+         * @return bool true on success, false if RPM was not set or the move is too long for the microstep setting.
+         */
+        bool stepAsync(MoveHandle &handle, uint32_t steps, MotorDir dir, MotorStyle style = SINGLE, StepperMotorCB_t _Nullable callback_fn = NULL, void * _Nullable callback_fn_data = NULL);
+
+        /**
+         * @brief Stage a move segment without starting it. Staged segments are handed to the stepping
+         * worker by {@link Adafruit::StepperMotor::flush} and are executed back to back, without stopping
+         * the step timer in between, at the speed set using {@link Adafruit::StepperMotor::setSpeed}.
+         * A call to {@link Adafruit::StepperMotor::step} also flushes any staged segments ahead of its own move.
+         *
+         * @param steps Number of steps to move.
+         * @param dir The direction of movement, can be FORWARD or BACKWARD.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
+         * @param callback_fn Optional callback function of type {@link StepperMotorCB_t} to be executed after each (micro)step.
+         * @param callback_fn_data Optional data to be passed to the callback function.
+         * @return bool true on success, false if RPM was not set or {@link ADAFRUIT_STEPPER_QUEUE_DEPTH} segments are already queued.
+         */
+        bool enqueue(uint32_t steps, MotorDir dir, MotorStyle style = SINGLE, StepperMotorCB_t _Nullable callback_fn = NULL, void * _Nullable callback_fn_data = NULL);
+
+        /**
+         * @brief Start executing all segments staged using {@link Adafruit::StepperMotor::enqueue}.
+         * Returns immediately.
+         *
+         */
+        void flush();
+
+        /**
+         * @brief Wait until all flushed segments and non-blocking moves have completed.
+         *
+         */
+        void waitIdle();
+
+        /**
+         * @brief Get a file descriptor that becomes readable when moves of this motor complete, to wait for motors
+         * using poll(), select() or epoll alongside other file descriptors instead of a thread per motor. Reading
+         * 8 bytes from it returns the number of moves (blocking or non-blocking {@link Adafruit::StepperMotor::step} calls,
+         * segments added using {@link Adafruit::StepperMotor::enqueue} or coordinated moves) completed since the last read,
+         * and clears it. The descriptor is non-blocking, is owned by the motor and must not be closed.
+         *
+         * @return int eventfd file descriptor, -1 if the motor was not initialized using {@link Adafruit::MotorShield::getStepper}.
          */
-        void _Catchable step(uint16_t steps, MotorDir dir, MotorStyle style = SINGLE, bool blocking = true, StepperMotorCB_t _Nullable callback_fn = NULL, void * _Nullable callback_fn_data = NULL);
+        int getEventFd() const;
+
+        /**
+         * @brief Run the stepping thread of the motor under the SCHED_FIFO real-time policy and optionally pin it to a CPU,
+         * so that step timing is not disturbed by other load. Requires CAP_SYS_NICE or an RLIMIT_RTPRIO of at least the priority.
+         *
+         * @param priority SCHED_FIFO priority (1-99), 0 to return to the default time-sharing policy.
+         * @param cpu Optional, CPU to pin the thread to, -1 (default) leaves the CPU affinity unchanged.
+         * @return bool true on success, false if the motor was not initialized using {@link Adafruit::MotorShield::getStepper} or the policy or affinity could not be set.
+         */
+        bool setRealtime(int priority, int cpu = -1);
 
         /**
          * @brief Move the stepper motor by one step. No delays implemented.
@@ -283,6 +793,7 @@ namespace Adafruit
          * at a non-integral step while microstepping. Use this function in
          * conjunction with {@link Adafruit::StepperMotor::getStepPeriod} function
          * that gives the time (in microseconds) required to execute a full step.
+         * Waits for a move in progress to finish.
          *
          * @param dir The direction of movement, can be FORWARD or BACKWARD.
          * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP.
@@ -293,11 +804,13 @@ namespace Adafruit
         uint8_t onestep(MotorDir dir, MotorStyle style);
 
         /**
-         * @brief Set microsteps per step.
+         * @brief Set microsteps per step. The position (see {@link Adafruit::StepperMotor::getPosition}) and the coil
+         * phase are converted to the new microsteps. With fewer microsteps per step, they have to fall on a whole
+         * microstep of the new setting, including the position at the end of queued moves.
          *
          * @param microsteps {\@link Adafruit::MicroSteps} members.
          *
-         * @return bool true on success, false on failure.
+         * @return bool true on success, false if the motor is moving or the position can not be converted exactly.
          */
         bool setStep(MicroSteps microsteps);
 
@@ -315,7 +828,9 @@ namespace Adafruit
         bool isMoving() const;
 
         /**
-         * @brief Stop stepping the motor.
+         * @brief Stop stepping the motor and cancel all pending moves. The move in progress stops at its next (integral) step
+         * and ends as MOVE_STOPPED. Moves that have not started, including segments staged using {@link Adafruit::StepperMotor::enqueue}
+         * and not flushed yet, end as MOVE_CANCELLED without taking a step. Moves issued after the call run normally.
          *
          */
         void stopMotor();
@@ -328,16 +843,157 @@ namespace Adafruit
          */
         uint64_t _Catchable getStepPeriod() const;
 
+        /**
+         * @brief Get the absolute position of the motor in microsteps, counted from the position set using
+         * {@link Adafruit::StepperMotor::setPosition} (0 when the motor is created). A full step is `microsteps`
+         * microsteps, an INTERLEAVE half step is `microsteps / 2` microsteps. Updated on every step, and can be
+         * read while the motor is moving. {@link Adafruit::StepperMotor::setStep} converts it exactly to the new microsteps.
+         *
+         * @return int64_t Position in microsteps.
+         */
+        int64_t getPosition() const;
+
+        /**
+         * @brief Get the step timing statistics of the motor, can be called while the motor is moving.
+         *
+         * @param stats Statistics since the motor was created or {@link Adafruit::StepperMotor::resetStats} was called.
+         * @return bool true if {@link ADAFRUIT_MOTORSHIELD_STATS} is enabled, false otherwise (stats are zeroed).
+         */
+        bool getStats(StepperMotorStats &stats) const;
+
+        /**
+         * @brief Get the number of times the motor fell more than {@link ADAFRUIT_STEPPER_MAX_CATCHUP} step periods behind its
+         * schedule and restarted it, lengthening the move. Available regardless of {@link ADAFRUIT_MOTORSHIELD_STATS}.
+         *
+         * @return uint32_t Number of overruns since the motor was created.
+         */
+        uint32_t getOverruns() const;
+
+        /**
+         * @brief Reduce the coil current of the motor while it holds its position, to save power and keep the drivers cool.
+         * Once the motor was idle for idle_ms milliseconds after a move or {@link Adafruit::StepperMotor::onestep}, both PWM
+         * outputs are scaled to percent of their value at the last (micro)step, in one I2C transaction. The coils stay
+         * energized in the same phase, so the position is kept, and the next move starts at the full current on its first step.
+         * The current is not reduced after {@link Adafruit::StepperMotor::release}, {@link Adafruit::MotorShield::allOff} or an
+         * emergency stop. The reduction is disabled (100%) by default.
+         *
+         * @param percent Hold current in percent of the current while moving, 0-100. 100 disables the reduction.
+         * @param idle_ms Optional, idle time before the current is reduced, {@link ADAFRUIT_STEPPER_HOLD_DELAY_MS} by default.
+         * @return bool true on success, false if percent is out of range.
+         */
+        bool setHoldCurrent(uint8_t percent, uint32_t idle_ms = ADAFRUIT_STEPPER_HOLD_DELAY_MS);
+
+        /**
+         * @brief Coalesce the step callbacks of subsequent moves (see {@link Adafruit::StepperMotor::step}), e.g. to report
+         * progress without handling every microstep. The callback is called after every every_steps (micro)steps of a move,
+         * but not more often than once every min_interval_ms milliseconds. By default it is called after every (micro)step.
+         *
+         * @param every_steps Number of (micro)steps per callback, at least 1.
+         * @param min_interval_ms Optional, minimum time between callbacks in milliseconds, default 0.
+         * @return bool true on success, false if every_steps is 0.
+         */
+        bool setCallbackRate(uint32_t every_steps, uint32_t min_interval_ms = 0);
+
+        /**
+         * @brief Get the number of step callbacks that were dropped because the callback thread fell
+         * {@link ADAFRUIT_STEPPER_CALLBACK_DEPTH} callbacks behind the motor.
+         *
+         * @return uint32_t Number of dropped callbacks since the motor was created.
+         */
+        uint32_t getDroppedCallbacks() const;
+
+        /**
+         * @brief Reset the step timing statistics of the motor.
+         *
+         */
+        void resetStats();
+
+        /**
+         * @brief Set the current absolute position of the motor, e.g. to 0 after homing.
+         *
+         * @param position Position in microsteps.
+         * @return bool true on success, false if the motor is moving or moves are queued.
+         */
+        bool setPosition(int64_t position);
+
+        /**
+         * @brief Move to an absolute position, as one continuous move at the speed set using {@link Adafruit::StepperMotor::setSpeed}.
+         * The move starts from the position where the moves queued before it end. With a stepping style other than
+         * MICROSTEP the distance is rounded towards the current position to a whole number of (half) steps.
+         * Throws exception if RPM was not set prior to call.
+         *
+         * @param position Target position in microsteps, see {@link Adafruit::StepperMotor::getPosition}.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. MICROSTEP by default, which reaches any position.
+         * @param blocking Whether the function blocks until the move is complete. Set to true by default.
+         * @return bool true on success, false if the motor was not initialized or the distance is too long for a single move.
+         */
+        bool _Catchable goTo(int64_t position, MotorStyle style = MICROSTEP, bool blocking = true);
+
+        /**
+         * @brief Move by a signed number of steps, like {@link Adafruit::StepperMotor::step} in the FORWARD direction for
+         * positive steps and BACKWARD for negative steps. Throws exception if RPM was not set prior to call.
+         *
+         * @param steps Number of steps to move, in the units of {@link Adafruit::StepperMotor::step}.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
+         * @param blocking Whether the function blocks until the move is complete. Set to true by default.
+         * @return bool true on success, false if the motor was not initialized or the distance is too long for a single move.
+         */
+        bool _Catchable moveRelative(int32_t steps, MotorStyle style = SINGLE, bool blocking = true);
+
         friend class MotorShield; ///< Let MotorShield create StepperMotors
+        friend class MoveHandle;  ///< Let MoveHandle retrieve move results
+        friend class TrajectoryPlayer; ///< Let TrajectoryPlayer take over the motor
+        friend class ShieldServer;     ///< Let ShieldServer check the queue of the motor
 
     protected:
         uint64_t usperstep;
         MicroSteps microsteps;
 
     private:
-        std::mutex cs;
-        std::condition_variable cond;
-        uint16_t *microstepcurve;
+        std::mutex cs; // held by the worker for the duration of a move, taken before queue_lock
+        std::mutex queue_lock;
+        std::condition_variable cond;      // wakes up the worker
+        std::condition_variable done_cond; // signals completion of a queued command
+        StepperMotorTimerData queue[ADAFRUIT_STEPPER_QUEUE_DEPTH];
+        uint32_t qhead, qtail, qstaged; // free running indices into queue: [qhead, qtail) flushed, [qtail, qstaged) staged
+        uint32_t completed;    // number of commands completed by the worker
+        std::atomic<int64_t> position; // absolute position in microsteps, written by the stepping thread
+        int64_t planned;        // position at the end of all queued commands, protected by queue_lock
+        uint16_t plannedstep;   // currentstep at the end of all queued commands, protected by queue_lock
+        StepperMotorMoveResult results[ADAFRUIT_STEPPER_RESULT_DEPTH]; // indexed by ticket, the command index + 1
+        std::thread worker;
+        int timerfd;
+        int donefd;        // eventfd counting completed commands for poll()ing callers
+        // step callbacks, queued by the stepping thread (SPSC) and called by the dispatcher thread
+        StepperMotorNotification cbqueue[ADAFRUIT_STEPPER_CALLBACK_DEPTH];
+        std::atomic<uint32_t> cbhead, cbtail; // free running indices into cbqueue
+        std::atomic<uint32_t> cb_every, cb_interval_ms, cb_dropped;
+        uint32_t cb_count;   // (micro)steps since the last callback, stepping thread only
+        uint64_t cb_last_ns; // time of the last callback, stepping thread only
+        std::atomic<bool> cb_sleeping, cb_quit;
+        int cbfd; // wakes up the dispatcher
+        std::thread dispatcher;
+        std::mutex cb_lock;
+        std::condition_variable cb_cond; // signals dispatched callbacks
+        bool quit;
+        RampProfile ramp_profile;
+        double ramp_accel;     // RPM/s
+        double ramp_start_rpm; // RPM, <= 0 for automatic
+        StepperMotorRamp ramp;
+        std::atomic<uint32_t> speed_gen; // incremented by setSpeed, so a running move picks up the new speed
+        uint32_t speed_seen;             // speed_gen of the step period in use by the worker
+        uint64_t tick_deadline;          // CLOCK_MONOTONIC time of the last (micro)step on the schedule, ns
+        std::atomic<uint32_t> overruns;
+        // hold current reduction, protected by queue_lock
+        uint8_t hold_percent;
+        uint32_t hold_delay_ms;
+        uint64_t hold_since; // CLOCK_MONOTONIC time the coils started holding at full current, ns, 0 if not holding
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        StatsHistogram stat_lateness;
+        std::atomic<uint32_t> stat_ticks, stat_missed;
+#endif
+        StepperMotorStepEntry stepentry;        // MICROSTEP coil energization, generated on every step
+        const StepperMotorStepEntry *lastentry; // last step written to the coils, nullptr if released
         uint8_t PWMApin, AIN1pin, AIN2pin;
         uint8_t PWMBpin, BIN1pin, BIN2pin;
         uint16_t revsteps; // # steps per revolution
@@ -345,7 +1001,114 @@ namespace Adafruit
         MotorShield *MC;
         bool initd;
         volatile bool moving;
-        volatile bool stop;
+        std::atomic<uint32_t> stop_gen; // incremented by stopMotor(), moves queued with an older generation are stopped
+    };
+
+#ifndef _DOXYGEN_
+    struct MotorShieldBusRequest
+    {
+        MotorShield *shield;
+        uint8_t first;
+        uint8_t num;
+        uint8_t regs[4 * 16];
+    };
+#endif
+
+    /**
+     * @brief Arbitrates access to an I2C bus shared by stacked motor shields.
+     * Every I2C transaction of a {@link Adafruit::MotorShield} is made while holding the lock of the
+     * bus object for its bus number, shared by all shields on that bus. The lock is granted in
+     * first-come, first-served order, so a shield that is stepping rapidly can not starve the other
+     * shields on the bus. The lock is recursive, and can be held across several transactions on
+     * multiple shields to issue them back to back, see {@link Adafruit::ShieldStack::Batch}.
+     *
+     * Each bus object also runs a bus owner thread that executes register writes submitted through
+     * a bounded, lock-free queue, e.g. by {@link Adafruit::DCMotor}, so that callers do not wait for the bus.
+     * While the queue is full, further writes of a shield are merged per channel, and the latest contents
+     * of each channel are written once the owner thread has executed the queue, so callers do not wait then either.
+     *
+     */
+    class MotorShieldBus
+    {
+    public:
+        /**
+         * @brief Get the bus object for an I2C bus number, creating it if required.
+         *
+         * @param bus I2C bus number.
+         * @return MotorShieldBus* nullptr if {@link ADAFRUIT_MAX_I2C_BUSES} buses are already in use.
+         */
+        static MotorShieldBus *get(int bus);
+
+        /**
+         * @brief Release a bus object obtained using {@link Adafruit::MotorShieldBus::get}.
+         *
+         * @param bus Bus object.
+         */
+        static void put(MotorShieldBus *bus);
+
+        /**
+         * @brief Wait for and take exclusive access to the bus.
+         *
+         */
+        void lock();
+
+        /**
+         * @brief Release access to the bus.
+         *
+         */
+        void unlock();
+
+        /**
+         * @brief Get the I2C bus number.
+         *
+         * @return int Bus number.
+         */
+        int id() const;
+
+#ifndef _DOXYGEN_
+        MotorShieldBus();
+#endif
+
+        friend class MotorShield; ///< Let MotorShield submit register writes
+
+    private:
+        struct Cell
+        {
+            std::atomic<uint32_t> seq;
+            MotorShieldBusRequest req;
+        };
+
+        bool submit(const MotorShieldBusRequest &req, uint32_t &pos);
+        void coalesce(MotorShield *shield); // list a shield with coalesced writes for the owner thread
+        bool runCoalesced();                // call holding the bus
+        void drain();                       // execute all queued and coalesced writes, call holding the bus
+        void wake();
+        bool start();
+        void stop();
+        bool runOne();
+        bool held();
+        bool setRealtime(int priority, int cpu);
+        static void ownerFn(MotorShieldBus *bus);
+
+        std::mutex m;
+        std::condition_variable cv;
+        uint32_t next_ticket, serving;
+        std::thread::id owner;
+        uint32_t depth;
+        int busnum;
+        int refs;
+
+        // bounded MPSC queue of register writes, executed by the bus owner thread
+        Cell cells[ADAFRUIT_BUS_QUEUE_DEPTH];
+        std::atomic<uint32_t> enqueue_pos;
+        std::atomic<uint32_t> dequeue_pos; // requests before this position have been executed
+        std::atomic<MotorShield *> coalesced; // shields with writes coalesced while the queue was full, linked by pending_next
+        std::atomic<bool> sleeping;
+        std::atomic<bool> quit;
+        int wakefd;
+        std::thread ownerthread;
+        std::mutex sync_lock;
+        std::condition_variable sync_cond;
     };
 
     /**
@@ -370,9 +1133,26 @@ namespace Adafruit
          * @param sig Signal.
          */
         static void sighandler(int sig);
+
+        /**
+         * @brief Stop all steppers and turn off every output of all initialized motor shields, one I2C transaction
+         * per shield. Async-signal-safe: the outputs are turned off by a dedicated thread, and this function waits
+         * up to {@link ADAFRUIT_ESTOP_WAIT_MS} for it. Called by the signal handler of the library.
+         *
+         */
+        static void emergencyStop();
+
+        /**
+         * @brief Set the I2C backend used by motor shields created after this call, e.g. a mock bus for tests and
+         * benchmarks. Shields keep the backend they were created with.
+         *
+         * @param backend Backend functions, which have to stay valid while shields use them. NULL restores the default i2cbus backend.
+         */
+        static void setI2CBackend(const I2CBackend * _Nullable backend);
         
         /**
-         * @brief Create the Motor Shield object at an I2C address (default: 0x60) on an I2C bus (default: 1). Throws runtime error if sigaction() fails on register_sighandler = true.
+         * @brief Create the Motor Shield object at an I2C address (default: 0x60) on an I2C bus (default: 1). Throws runtime error if sigaction() fails on register_sighandler = true,
+         * or if motor shields are already in use on {@link ADAFRUIT_MAX_I2C_BUSES} other buses.
          *
          * @param addr Optional, default: 0x60
          * @param bus Optional, default: 1
@@ -392,9 +1172,54 @@ namespace Adafruit
          *
          * @param freq The PWM frequency for the driver, used for speed control and microstepping.
          * By default 1600 Hz is used, which is a little audible but efficient.
+         * @param warm_start Optional, read the state of the driver first (MODE1 to the last output in one burst, then the pre-scaler),
+         * and skip the initialization if the driver is already configured for the frequency, e.g. after a restart of the application.
+         * If any output is on, all outputs are turned off in one write.
          * @return bool true on success, false on failure
          */
-        bool _Catchable begin(uint16_t freq = 1600);
+        bool _Catchable begin(uint16_t freq = 1600, bool warm_start = false);
+
+        /**
+         * @brief Change the PWM frequency of an initialized shield. The outputs keep their settings, and the
+         * change takes ~0.5 ms during which the outputs are off. The prescaler limits the frequency to
+         * oscillator / 4096 / 256 up to oscillator / 4096 / 4, ~26 Hz to ~1700 Hz by default, frequencies out of range are clamped.
+         *
+         * @param freq The PWM frequency in Hz.
+         * @return bool true if the prescaler was written and verified, false otherwise.
+         */
+        bool setFrequency(uint16_t freq);
+
+        /**
+         * @brief Set the oscillator frequency the prescaler is calculated for, e.g. the measured frequency of
+         * the internal oscillator of a particular board, by default {@link ADAFRUIT_PCA9685_OSC_HZ}. Takes effect
+         * with the next call to {@link Adafruit::MotorShield::setFrequency} or {@link Adafruit::MotorShield::begin}.
+         *
+         * @param hz Oscillator frequency in Hz.
+         */
+        void setOscillatorFrequency(uint32_t hz);
+
+        /**
+         * @brief Switch the PWM driver of an initialized shield to a clock on its EXTCLK pin, and recalculate the prescaler
+         * for the current PWM frequency. The driver only returns to the internal oscillator after a power cycle.
+         *
+         * @param hz Frequency of the external clock in Hz, up to 50 MHz.
+         * @return bool true on success, false on failure.
+         */
+        bool setExternalClock(uint32_t hz);
+
+        /**
+         * @brief Get the prescaler value in use, the PWM period is (prescale + 1) * 4096 oscillator cycles.
+         *
+         * @return uint8_t Prescaler value, 0 if the shield is not initialized.
+         */
+        uint8_t getPrescale() const;
+
+        /**
+         * @brief Get the PWM frequency resulting from the prescaler and the oscillator frequency.
+         *
+         * @return double PWM frequency in Hz, 0 if the shield is not initialized.
+         */
+        double getFrequency() const;
 
         /**
          * @brief Returns a pointer to an already-allocated
@@ -405,6 +1230,23 @@ namespace Adafruit
          */
         DCMotor *getMotor(uint8_t n);
 
+        /**
+         * @brief Set the direction and speed of several DC motors at once. The new register contents are staged on a copy
+         * of the driver state and the changed channels are written in one I2C transaction, so all motors change together.
+         * Ramps of the updated motors are cancelled, motor commands already queued for the bus are written before.
+         *
+         * Example:
+         * ```
+         * Adafruit::DCCommand cmds[4] = {{Adafruit::FORWARD, 2000}, {Adafruit::BACKWARD, 2000}};
+         * AFMS.applyDC(cmds, 0x3); // motors 1 and 2
+         * ```
+         *
+         * @param cmds Commands for motors 1 thru 4.
+         * @param mask Motors to update, bit n for motor n + 1. Motors not obtained with {@link Adafruit::MotorShield::getMotor} are skipped.
+         * @return bool true on success, false on failure (unknown direction, I2C error)
+         */
+        bool applyDC(const DCCommand cmds[4], uint8_t mask = 0xf);
+
         /**
          * @brief  Returns a pointer to an already-allocated
          * {@link Adafruit::StepperMotor} object with a given steps per rotation.
@@ -417,6 +1259,88 @@ namespace Adafruit
          */
         StepperMotor *getStepper(uint16_t steps, uint8_t port, MicroSteps microsteps = STEP16);
 
+        /**
+         * @brief Move both stepper motors of the shield together so that they start and arrive at the same time,
+         * e.g. for a diagonal move of an XY stage. The axis with more (micro)steps runs at its own speed set using
+         * {@link Adafruit::StepperMotor::setSpeed}, with its acceleration profile, and the other axis is interpolated.
+         * Both axes are driven from a single step timer, and the coils of both ports (channels 2-13) are updated
+         * together in one I2C transaction per step. The move is queued on the stepper at port 1, and starts once both
+         * steppers are done with their previous moves. Throws exception if RPM was not set for the faster axis.
+         *
+         * @param steps1 Number of steps to move the stepper at port 1.
+         * @param dir1 Direction of movement of the stepper at port 1, can be FORWARD or BACKWARD.
+         * @param steps2 Number of steps to move the stepper at port 2.
+         * @param dir2 Direction of movement of the stepper at port 2, can be FORWARD or BACKWARD.
+         * @param style Stepping style for both steppers, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
+         * @param blocking Whether the function blocks until the move is complete. Set to true by default.
+         * @return bool true on success, false if either stepper was not initialized using {@link Adafruit::MotorShield::getStepper}.
+         */
+        bool _Catchable stepCoordinated(uint32_t steps1, MotorDir dir1, uint32_t steps2, MotorDir dir2, MotorStyle style = SINGLE, bool blocking = true);
+
+        /**
+         * @brief Wait until all asynchronous updates submitted for this shield, i.e. all
+         * {@link Adafruit::DCMotor} commands issued so far, have been written to the shield.
+         *
+         */
+        void sync();
+
+        /**
+         * @brief Get the I2C address of the shield.
+         *
+         * @return uint8_t I2C address.
+         */
+        uint8_t getAddress() const;
+
+        /**
+         * @brief Get the I2C statistics of the shield, can be called at any time.
+         *
+         * @param stats Statistics since the shield was created or {@link Adafruit::MotorShield::resetStats} was called.
+         * @return bool true if {@link ADAFRUIT_MOTORSHIELD_STATS} is enabled, false otherwise (stats are zeroed).
+         */
+        bool getStats(MotorShieldStats &stats) const;
+
+        /**
+         * @brief Set the retry policy for failed I2C transactions of the shield.
+         *
+         * @param policy Retry policy, see {@link Adafruit::RetryPolicy}.
+         * @return bool true on success, false if policy.max_attempts or policy.nak_attempts is 0.
+         */
+        bool setRetryPolicy(const RetryPolicy &policy);
+
+        /**
+         * @brief Get the retry policy for failed I2C transactions of the shield.
+         *
+         * @return RetryPolicy Retry policy in use.
+         */
+        RetryPolicy getRetryPolicy();
+
+        /**
+         * @brief Get the I2C error counts of the shield, can be called at any time.
+         *
+         * @param counts Counts since the shield was created or {@link Adafruit::MotorShield::resetStats} was called.
+         */
+        void getErrorCounts(I2CErrorCounts &counts) const;
+
+        /**
+         * @brief Reset the I2C statistics and error counts of the shield.
+         *
+         */
+        void resetStats();
+
+        /**
+         * @brief Run the threads timing the steppers of the shield and the thread writing to its I2C bus under the SCHED_FIFO
+         * real-time policy, optionally pinned to a CPU (e.g. one isolated using isolcpus), and lock the memory of the process
+         * to avoid page fault stalls. Applies to the steppers already obtained using {@link Adafruit::MotorShield::getStepper}
+         * and to those obtained later. The bus thread is shared by all shields on the bus, the last call sets its policy.
+         * Requires CAP_SYS_NICE or an RLIMIT_RTPRIO of at least the priority, and CAP_IPC_LOCK or a sufficient RLIMIT_MEMLOCK to lock memory.
+         *
+         * @param priority SCHED_FIFO priority (1-99), 0 to return to the default time-sharing policy.
+         * @param cpu Optional, CPU to pin the threads to, -1 (default) leaves the CPU affinity unchanged.
+         * @param lock_memory Optional, lock current and future memory of the process using mlockall(), default true. Ignored if priority is 0.
+         * @return bool true on success, false if any of the settings could not be applied (the reason is printed).
+         */
+        bool setRealtime(int priority, int cpu = -1, bool lock_memory = true);
+
         /**
          * @brief Helper that sets the PWM output on a pin and manages 'all on or off'.
          *
@@ -435,19 +1359,91 @@ namespace Adafruit
          */
         bool setPin(uint8_t pin, bool val);
 
+        /**
+         * @brief Set the PWM output of all 16 pins at once, in a single I2C transaction using the ALL_LED registers.
+         *
+         * @param val The 12-bit PWM value we want to set (0-4095) - 4096 is a special 'all on' value.
+         * @return bool true on success, false on failure
+         */
+        bool setAllPWM(uint16_t val);
+
+        /**
+         * @brief Emergency stop: turn off all pins, de-energizing every motor on the shield, in a single I2C transaction. Motor commands
+         * already queued for the bus are written before the pins are turned off, so none of them can turn a motor back on.
+         * Stepper motors are not stopped, use {@link Adafruit::StepperMotor::stopMotor} for that.
+         *
+         * @return bool true on success, false on failure
+         */
+        bool allOff();
+
+        friend class StepperMotor; ///< Let StepperMotor issue burst writes and run coordinated moves
+        friend class DCMotor; ///< Let DCMotor submit asynchronous writes and ramps
+        friend class MotorShieldBus; ///< Let the bus owner thread execute submitted writes
+        friend class TrajectoryPlayer; ///< Let TrajectoryPlayer write trajectory ticks
+        friend class ShieldServer;     ///< Let ShieldServer publish the address of the shield
+
     private:
+        static void estopFn(int fd);
+        bool registerShield();
+        void unregisterShield();
         bool initd;
         uint8_t _addr;
         int _bus;
         uint16_t _freq;
+        uint32_t osc_hz;
+        bool extclk;
+        uint8_t prescale; // in use, 0 if not configured
         DCMotor dcmotors[4];
         StepperMotor steppers[2];
         i2cbus bus[1];
+        const I2CBackend *i2c;
+        int rt_priority, rt_cpu; // real-time settings for stepper threads, see setRealtime()
+        MotorShieldBus *busmgr;
+        std::atomic<uint32_t> async_pos; // bus queue position following the last submitted write
+        std::mutex pending_lock;         // coalesced writes, taken without the bus or after it
+        uint8_t pending[4 * 16];         // latest contents of the channels written while the bus queue was full
+        uint16_t pending_mask;           // channels in pending
+        bool pending_listed;             // on the coalesced list of the bus, or being written by the owner thread
+        MotorShield *pending_next;       // next shield on the coalesced list of the bus
+        uint8_t shadow[4 * 16]; // last LEDn_ON/LEDn_OFF register contents written to the chip
+        uint16_t shadow_valid;  // bit n set if shadow holds the contents of channel n
+#if ADAFRUIT_MOTORSHIELD_STATS > 0
+        StatsHistogram stat_latency;
+        std::atomic<uint32_t> stat_transactions, stat_retries, stat_failures;
+#endif
+        RetryPolicy retry; // protected by the bus
+        bool failing;      // last transaction failed
+        std::atomic<uint32_t> err_busy, err_timeouts, err_naks, err_other, err_retries, err_failures, err_budget;
+        // DC motor ramps, updated by the ramper thread
+        std::mutex ramp_lock; // taken after the bus
+        std::condition_variable ramp_cond;
+        std::thread ramper;
+        int rampfd;
+        bool ramp_quit;
+        uint8_t ramps_active;
+        static void rampFn(MotorShield *shield);
+        bool startRamper(); // call with ramp_lock held
+        void stopRamper();
+        void rampTick();
+        bool commitChannels(const uint8_t *regs, uint16_t mask);
+        bool swapChannels(uint8_t first, uint8_t num, const uint8_t *expect, const uint8_t *regs);
+        bool applyTick(const int8_t steps[2], MotorStyle style, const int16_t pwm[4], uint8_t dc_mask); // call holding the bus
+        static uint32_t estopEpoch();
         bool reset();
-        bool setPWMFreq(float freq);
+        bool configure(uint8_t prescale, bool extclk);
+        bool warmStart(uint16_t freq);
+        uint8_t calcPrescale(uint16_t freq, bool &clamped) const;
         bool setPWM(uint8_t num, uint16_t on, uint16_t off);
+        bool writeChannels(uint8_t first, uint8_t num, const uint8_t *regs, bool atomic = false);
+        bool burstWrite(uint8_t first, uint8_t num, const uint8_t *regs);
+        bool writeAll(const uint8_t *regs);
+        bool submitChannels(uint8_t first, uint8_t num, const uint8_t *regs);
+        void flushCoalesced(); // call holding the bus
+        bool coalescing();
+        bool channelCached(uint8_t ch, const uint8_t *regs) const;
         uint8_t _Catchable read8(uint8_t addr);
         bool write8(uint8_t addr, uint8_t d);
+        bool transfer(const uint8_t *buf, ssize_t len, uint8_t *rbuf = nullptr, ssize_t rlen = 0);
     };
 };
 
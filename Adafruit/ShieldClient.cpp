@@ -0,0 +1,325 @@
+/*!
+ * @file ShieldClient.cpp
+ *
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ *
+ * @brief This is the implementation file for the client of motorshieldd.
+ *
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * BSD license, all text here must be included in any redistribution.
+ *
+ */
+
+#include "ShieldClient.hpp"
+#include "meb_print.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef _DOXYGEN_
+static inline uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+// milliseconds left until the deadline, rounded up, -1 to wait forever, 0 if it passed
+static inline int64_t remainingMs(int64_t timeout_ms, uint64_t deadline)
+{
+    if (timeout_ms < 0)
+        return -1;
+    uint64_t now = monotonicNs();
+    return now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+}
+
+static inline Adafruit::ShmCommand makeCommand(Adafruit::ShmOp op, uint8_t shield, uint8_t motor)
+{
+    Adafruit::ShmCommand cmd;
+    memset(&cmd, 0x0, sizeof(cmd));
+    cmd.op = op;
+    cmd.shield = shield;
+    cmd.motor = motor;
+    return cmd;
+}
+#endif // _DOXYGEN_
+
+namespace Adafruit
+{
+    ShieldClient::ShieldClient()
+    {
+        seg = nullptr;
+        ring = nullptr;
+        failures = 0;
+    }
+
+    ShieldClient::~ShieldClient()
+    {
+        disconnect();
+    }
+
+    bool ShieldClient::connect(const char *name)
+    {
+        disconnect();
+        int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            bprintlf("Error %d connecting to motorshieldd on %s: %s", errno, name, strerror(errno));
+            return false;
+        }
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmSegment))
+            addr = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+        {
+            bprintlf("Could not map shared memory %s of motorshieldd", name);
+            return false;
+        }
+        ShmSegment *seg = (ShmSegment *)addr;
+        if (seg->magic.load(std::memory_order_acquire) != ADAFRUIT_SHM_MAGIC || seg->version != ADAFRUIT_SHM_VERSION || seg->size != sizeof(ShmSegment))
+        {
+            bprintlf("Shared memory %s is not a motorshieldd segment of version %d", name, ADAFRUIT_SHM_VERSION);
+            munmap(addr, sizeof(ShmSegment));
+            return false;
+        }
+        if (seg->quit)
+        {
+            bprintlf("motorshieldd on %s has stopped", name);
+            munmap(addr, sizeof(ShmSegment));
+            return false;
+        }
+        // take a free ring, or one left behind by a client that exited without disconnecting
+        int32_t pid = getpid();
+        for (int pass = 0; pass < 2 && ring == nullptr; pass++)
+        {
+            for (int i = 0; i < ADAFRUIT_SHM_MAX_CLIENTS; i++)
+            {
+                int32_t owner = seg->rings[i].owner.load();
+                if (owner != 0 && (pass == 0 || kill(owner, 0) == 0 || errno != ESRCH))
+                    continue;
+                if (seg->rings[i].owner.compare_exchange_strong(owner, pid))
+                {
+                    ring = &seg->rings[i];
+                    break;
+                }
+            }
+        }
+        if (ring == nullptr)
+        {
+            bprintlf("motorshieldd on %s has %d clients already", name, ADAFRUIT_SHM_MAX_CLIENTS);
+            munmap(addr, sizeof(ShmSegment));
+            return false;
+        }
+        this->seg = seg;
+        failures = ring->failures.load();
+        return true;
+    }
+
+    void ShieldClient::disconnect()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        if (seg == nullptr)
+            return;
+        ring->owner.store(0);
+        munmap(seg, sizeof(ShmSegment));
+        seg = nullptr;
+        ring = nullptr;
+    }
+
+    bool ShieldClient::connected() const
+    {
+        return seg != nullptr && !seg->quit;
+    }
+
+    uint8_t ShieldClient::size() const
+    {
+        return seg == nullptr ? 0 : seg->nshields;
+    }
+
+    int ShieldClient::find(uint8_t addr) const
+    {
+        ShieldStatus status;
+        for (uint8_t i = 0; i < size(); i++)
+        {
+            if (getStatus(i, status) && status.addr == addr)
+                return i;
+        }
+        return -1;
+    }
+
+    bool ShieldClient::attachStepper(uint8_t shield, uint8_t port, uint16_t steps, MicroSteps microsteps)
+    {
+        ShmCommand cmd = makeCommand(SHM_ATTACH, shield, port);
+        cmd.value = steps;
+        cmd.arg = microsteps;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::setSpeed(uint8_t shield, uint8_t port, double rpm)
+    {
+        ShmCommand cmd = makeCommand(SHM_SPEED, shield, port);
+        cmd.fvalue = rpm;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::step(uint8_t shield, uint8_t port, uint32_t steps, MotorDir dir, MotorStyle style)
+    {
+        ShmCommand cmd = makeCommand(SHM_STEP, shield, port);
+        cmd.value = steps;
+        cmd.dir = dir;
+        cmd.style = style;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::goTo(uint8_t shield, uint8_t port, int64_t position, MotorStyle style)
+    {
+        ShmCommand cmd = makeCommand(SHM_GOTO, shield, port);
+        cmd.value = position;
+        cmd.style = style;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::setPosition(uint8_t shield, uint8_t port, int64_t position)
+    {
+        ShmCommand cmd = makeCommand(SHM_SETPOS, shield, port);
+        cmd.value = position;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::stopMotor(uint8_t shield, uint8_t port)
+    {
+        return submit(makeCommand(SHM_STOP, shield, port));
+    }
+
+    bool ShieldClient::release(uint8_t shield, uint8_t port)
+    {
+        return submit(makeCommand(SHM_RELEASE, shield, port));
+    }
+
+    bool ShieldClient::runDC(uint8_t shield, uint8_t motor, MotorDir dir, uint16_t speed)
+    {
+        ShmCommand cmd = makeCommand(SHM_DC, shield, motor);
+        cmd.dir = dir;
+        cmd.value = speed;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::rampDC(uint8_t shield, uint8_t motor, int16_t speed, uint32_t duration_ms)
+    {
+        ShmCommand cmd = makeCommand(SHM_DCRAMP, shield, motor);
+        cmd.value = speed;
+        cmd.arg = duration_ms;
+        return submit(cmd);
+    }
+
+    bool ShieldClient::sync(int64_t timeout_ms)
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        if (ring == nullptr)
+            return false;
+        if (!waitHead(ring->tail.load(std::memory_order_relaxed), timeout_ms) || seg->quit)
+            return false;
+        uint32_t count = ring->failures.load(std::memory_order_relaxed);
+        bool ok = count == failures;
+        failures = count;
+        return ok;
+    }
+
+    bool ShieldClient::getStatus(uint8_t shield, ShieldStatus &status) const
+    {
+        uint32_t seq;
+        return readStatus(shield, status, seq);
+    }
+
+    bool ShieldClient::waitIdle(uint8_t shield, uint8_t port, int64_t timeout_ms)
+    {
+        if (port < 1 || port > 2)
+        {
+            bprintlf("Motor number %u out of range [1-2]", port);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(this->lock); // disconnect() must not unmap the segment while it is in use
+        if (ring == nullptr)
+            return false;
+        uint64_t deadline = monotonicNs() + timeout_ms * 1000000;
+        // the status of the server reflects the commands once they are executed, failed ones are left to sync()
+        if (!waitHead(ring->tail.load(std::memory_order_relaxed), timeout_ms) || seg->quit)
+            return false;
+        ShieldStatus status;
+        uint32_t seq;
+        while (readStatus(shield, status, seq) && status.steppers[port - 1].moving)
+        {
+            int64_t left = remainingMs(timeout_ms, deadline);
+            if (left == 0 || seg->quit)
+                return false;
+            seg->status_waiters.fetch_add(1);
+            shmWait(seg->status_seq, seq, left);
+            seg->status_waiters.fetch_sub(1);
+        }
+        return !seg->quit && shield < seg->nshields;
+    }
+
+    bool ShieldClient::submit(const ShmCommand &cmd)
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        if (ring == nullptr)
+        {
+            bprintlf("Not connected to motorshieldd.");
+            return false;
+        }
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        if (!waitHead(tail - ADAFRUIT_SHM_RING_DEPTH + 1, ADAFRUIT_SHM_TIMEOUT_MS))
+        {
+            dbprintlf("Command ring full.");
+            return false;
+        }
+        ring->cmds[tail % ADAFRUIT_SHM_RING_DEPTH] = cmd;
+        ring->tail.store(tail + 1, std::memory_order_release);
+        // ring the doorbell before checking if the server sleeps, it samples them in the opposite order
+        seg->doorbell.fetch_add(1);
+        if (seg->sleeping.load())
+            shmWake(seg->doorbell);
+        return true;
+    }
+
+    bool ShieldClient::waitHead(uint32_t target, int64_t timeout_ms)
+    {
+        // call with lock held
+        uint64_t deadline = monotonicNs() + timeout_ms * 1000000;
+        while (true)
+        {
+            uint32_t head = ring->head.load(std::memory_order_acquire);
+            if ((int32_t)(head - target) >= 0)
+                return true;
+            int64_t left = remainingMs(timeout_ms, deadline);
+            if (left == 0 || seg->quit)
+                return false;
+            ring->waiters.fetch_add(1);
+            shmWait(ring->head, head, left);
+            ring->waiters.fetch_sub(1);
+        }
+    }
+
+    bool ShieldClient::readStatus(uint8_t shield, ShieldStatus &status, uint32_t &seq) const
+    {
+        if (seg == nullptr || shield >= seg->nshields)
+            return false;
+        while (true)
+        {
+            seq = seg->status_seq.load(std::memory_order_acquire);
+            if (seq & 0x1)
+                continue; // being written
+            memcpy(&status, &seg->status[shield], sizeof(status));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seg->status_seq.load(std::memory_order_relaxed) == seq)
+                return true;
+        }
+    }
+}
@@ -0,0 +1,219 @@
+/**
+ * @file ShieldClient.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Client of motorshieldd, controls the motors of shields owned by another process through shared memory.
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _ShieldClient_hpp_
+#define _ShieldClient_hpp_
+
+#include "ShieldShm.hpp"
+
+namespace Adafruit
+{
+    /**
+     * @brief Controls the motors of the shields of a {@link Adafruit::ShieldServer} (motorshieldd) from another process.
+     * Commands are written to a lock-free ring of the client in shared memory and executed by the server in order,
+     * without a system call unless the server is asleep. The state of the motors is read from a status page in the same
+     * shared memory. Shields are addressed by their index in the stack of the server, see {@link Adafruit::ShieldClient::find}.
+     *
+     * The command functions return once the command is queued. A false return means the command could not be queued;
+     * commands that fail when the server executes them are reported by {@link Adafruit::ShieldClient::sync}.
+     *
+     */
+    class ShieldClient
+    {
+    public:
+        /**
+         * @brief Create a client that is not connected.
+         *
+         */
+        ShieldClient();
+
+        /**
+         * @brief Disconnect from the server.
+         *
+         */
+        ~ShieldClient();
+
+        /**
+         * @brief Connect to a server.
+         *
+         * @param name Name of the shared memory segment of the server, {@link ADAFRUIT_SHM_NAME} by default.
+         * @return bool true on success, false if the server is not running, incompatible, or has {@link ADAFRUIT_SHM_MAX_CLIENTS} clients.
+         */
+        bool connect(const char *name = ADAFRUIT_SHM_NAME);
+
+        /**
+         * @brief Disconnect from the server. Queued commands are still executed.
+         *
+         */
+        void disconnect();
+
+        /**
+         * @brief Check if the client is connected to a running server.
+         *
+         * @return bool
+         */
+        bool connected() const;
+
+        /**
+         * @brief Get the number of shields of the server.
+         *
+         * @return uint8_t Number of shields, 0 if not connected.
+         */
+        uint8_t size() const;
+
+        /**
+         * @brief Find a shield of the server by its I2C address.
+         *
+         * @param addr I2C address of the shield.
+         * @return int Index of the shield, -1 if the server has no shield at the address.
+         */
+        int find(uint8_t addr) const;
+
+        /**
+         * @brief Create a stepper motor on the server, see {@link Adafruit::MotorShield::getStepper}.
+         * A motor that already exists is used as is.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @param steps Steps per revolution.
+         * @param microsteps Microsteps per step, STEP16 by default.
+         * @return bool true if the command was queued.
+         */
+        bool attachStepper(uint8_t shield, uint8_t port, uint16_t steps, MicroSteps microsteps = STEP16);
+
+        /**
+         * @brief Set the speed of a stepper motor, see {@link Adafruit::StepperMotor::setSpeed}.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @param rpm Speed in revolutions per minute.
+         * @return bool true if the command was queued.
+         */
+        bool setSpeed(uint8_t shield, uint8_t port, double rpm);
+
+        /**
+         * @brief Move a stepper motor without waiting for the move, see {@link Adafruit::StepperMotor::step}.
+         * The command fails if {@link ADAFRUIT_STEPPER_QUEUE_DEPTH} moves of the motor are queued.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @param steps Number of steps.
+         * @param dir FORWARD or BACKWARD.
+         * @param style Stepping style, SINGLE by default.
+         * @return bool true if the command was queued.
+         */
+        bool step(uint8_t shield, uint8_t port, uint32_t steps, MotorDir dir, MotorStyle style = SINGLE);
+
+        /**
+         * @brief Move a stepper motor to an absolute position without waiting for the move, see {@link Adafruit::StepperMotor::goTo}.
+         * The command fails if {@link ADAFRUIT_STEPPER_QUEUE_DEPTH} moves of the motor are queued.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @param position Target position in microsteps.
+         * @param style Stepping style, MICROSTEP by default.
+         * @return bool true if the command was queued.
+         */
+        bool goTo(uint8_t shield, uint8_t port, int64_t position, MotorStyle style = MICROSTEP);
+
+        /**
+         * @brief Set the position of an idle stepper motor, see {@link Adafruit::StepperMotor::setPosition}.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @param position Position in microsteps.
+         * @return bool true if the command was queued.
+         */
+        bool setPosition(uint8_t shield, uint8_t port, int64_t position);
+
+        /**
+         * @brief Stop a stepper motor, see {@link Adafruit::StepperMotor::stopMotor}.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @return bool true if the command was queued.
+         */
+        bool stopMotor(uint8_t shield, uint8_t port);
+
+        /**
+         * @brief Release a stepper motor, see {@link Adafruit::StepperMotor::release}.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @return bool true if the command was queued.
+         */
+        bool release(uint8_t shield, uint8_t port);
+
+        /**
+         * @brief Set the direction and speed of a DC motor, see {@link Adafruit::DCMotor::run} and {@link Adafruit::DCMotor::setSpeedFine}.
+         *
+         * @param shield Index of the shield.
+         * @param motor DC motor, 1 to 4.
+         * @param dir FORWARD, BACKWARD or RELEASE.
+         * @param speed 12-bit PWM value, 0-4095.
+         * @return bool true if the command was queued.
+         */
+        bool runDC(uint8_t shield, uint8_t motor, MotorDir dir, uint16_t speed);
+
+        /**
+         * @brief Ramp a DC motor to a new speed, see {@link Adafruit::DCMotor::rampTo}.
+         *
+         * @param shield Index of the shield.
+         * @param motor DC motor, 1 to 4.
+         * @param speed Target 12-bit PWM value, -4095 (BACKWARD) to 4095 (FORWARD).
+         * @param duration_ms Duration of the ramp in milliseconds.
+         * @return bool true if the command was queued.
+         */
+        bool rampDC(uint8_t shield, uint8_t motor, int16_t speed, uint32_t duration_ms);
+
+        /**
+         * @brief Wait until the server executed all commands queued by this client. Moves are started, not completed.
+         *
+         * @param timeout_ms Timeout in milliseconds, -1 (default) waits forever.
+         * @return bool true if all commands since the last sync succeeded, false if a command failed, the server stopped or the timeout expired.
+         */
+        bool sync(int64_t timeout_ms = -1);
+
+        /**
+         * @brief Read the state of a shield from the status page of the server, without a system call.
+         * The state is updated after every batch of commands and every {@link ADAFRUIT_SHM_STATUS_PERIOD_MS} milliseconds
+         * while a stepper motor moves.
+         *
+         * @param shield Index of the shield.
+         * @param status State of the shield.
+         * @return bool true on success, false if not connected or the index is out of range.
+         */
+        bool getStatus(uint8_t shield, ShieldStatus &status) const;
+
+        /**
+         * @brief Wait until all commands of this client are executed and a stepper motor is idle. Commands that failed
+         * are still reported by the next {@link Adafruit::ShieldClient::sync}. Like sync(), it holds the client while
+         * waiting, other threads using the same client submit their commands after it returns.
+         *
+         * @param shield Index of the shield.
+         * @param port Stepper port, 1 or 2.
+         * @param timeout_ms Timeout in milliseconds, -1 (default) waits forever.
+         * @return bool true if the motor is idle, false if the server stopped or the timeout expired.
+         */
+        bool waitIdle(uint8_t shield, uint8_t port, int64_t timeout_ms = -1);
+
+    private:
+        ShmSegment *seg;
+        ShmRing *ring;
+        std::mutex lock;   // serializes the producers of the ring
+        uint32_t failures; // failures of the server at the last sync, protected by lock
+        bool submit(const ShmCommand &cmd);
+        bool waitHead(uint32_t target, int64_t timeout_ms);
+        bool readStatus(uint8_t shield, ShieldStatus &status, uint32_t &seq) const;
+    };
+};
+
+#endif
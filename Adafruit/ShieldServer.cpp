@@ -0,0 +1,344 @@
+/*!
+ * @file ShieldServer.cpp
+ *
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ *
+ * @brief This is the implementation file for the server sharing a stack of Adafruit Motor Shield V2 boards with other processes.
+ *
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * BSD license, all text here must be included in any redistribution.
+ *
+ */
+
+#include "ShieldServer.hpp"
+#include "meb_print.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef _DOXYGEN_
+// check if the segment with the name belongs to a server that is still running
+static bool segmentInUse(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return errno != ENOENT;
+    struct stat st;
+    bool in_use = true;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Adafruit::ShmSegment))
+    {
+        void *addr = mmap(NULL, sizeof(Adafruit::ShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            const Adafruit::ShmSegment *seg = (const Adafruit::ShmSegment *)addr;
+            in_use = seg->magic.load() == ADAFRUIT_SHM_MAGIC && (kill(seg->pid, 0) == 0 || errno == EPERM);
+            munmap(addr, sizeof(Adafruit::ShmSegment));
+        }
+    }
+    else
+        in_use = false; // not initialized, or not ours
+    close(fd);
+    return in_use;
+}
+#endif // _DOXYGEN_
+
+namespace Adafruit
+{
+    ShieldServer::ShieldServer(ShieldStack &stack)
+    {
+        this->stack = &stack;
+        seg = nullptr;
+        name[0] = '\0';
+        quit = false;
+        memset(steppers, 0x0, sizeof(steppers));
+    }
+
+    ShieldServer::~ShieldServer()
+    {
+        close();
+    }
+
+    bool ShieldServer::open(const char *name, mode_t mode)
+    {
+        close();
+        if (strlen(name) >= sizeof(this->name))
+        {
+            bprintlf("Shared memory name %s too long", name);
+            return false;
+        }
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (fd < 0 && errno == EEXIST)
+        {
+            if (segmentInUse(name))
+            {
+                bprintlf("Shared memory %s is used by a running server", name);
+                return false;
+            }
+            dbprintlf("Replacing stale shared memory %s", name);
+            shm_unlink(name);
+            fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        }
+        if (fd < 0)
+        {
+            bprintlf("Error %d creating shared memory %s: %s", errno, name, strerror(errno));
+            return false;
+        }
+        fchmod(fd, mode); // not masked by the umask
+        void *addr = MAP_FAILED;
+        if (ftruncate(fd, sizeof(ShmSegment)) == 0)
+            addr = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            bprintlf("Error %d mapping shared memory %s: %s", errno, name, strerror(errno));
+            ::close(fd);
+            shm_unlink(name);
+            return false;
+        }
+        ::close(fd);
+        strcpy(this->name, name);
+        // the new segment is zeroed: all rings are free and empty
+        seg = (ShmSegment *)addr;
+        seg->version = ADAFRUIT_SHM_VERSION;
+        seg->nshields = stack->size();
+        seg->size = sizeof(ShmSegment);
+        seg->pid = getpid();
+        quit = false;
+        updateStatus();
+        seg->magic.store(ADAFRUIT_SHM_MAGIC, std::memory_order_release);
+        return true;
+    }
+
+    void ShieldServer::close()
+    {
+        if (seg == nullptr)
+            return;
+        seg->quit = 1;
+        for (int i = 0; i < ADAFRUIT_SHM_MAX_CLIENTS; i++)
+            shmWake(seg->rings[i].head);
+        shmWake(seg->status_seq);
+        munmap(seg, sizeof(ShmSegment));
+        seg = nullptr;
+        shm_unlink(name);
+    }
+
+    bool ShieldServer::run()
+    {
+        if (seg == nullptr)
+        {
+            bprintlf("Shared memory not open, please invoke open().");
+            return false;
+        }
+        uint32_t heads[ADAFRUIT_SHM_MAX_CLIENTS];
+        bool moving = updateStatus();
+        while (!quit)
+        {
+            // announce the sleep before sampling the doorbell, so a client ringing after the sample wakes us up
+            seg->sleeping = 1;
+            uint32_t bell = seg->doorbell.load();
+            bool executed = false;
+            for (int i = 0; i < ADAFRUIT_SHM_MAX_CLIENTS; i++)
+            {
+                ShmRing &ring = seg->rings[i];
+                uint32_t head = heads[i] = ring.head.load(std::memory_order_relaxed);
+                uint32_t tail = ring.tail.load(std::memory_order_acquire);
+                if (tail - head > ADAFRUIT_SHM_RING_DEPTH)
+                {
+                    bprintlf("Command ring %d corrupted (head %u, tail %u), dropping its commands", i, head, tail);
+                    heads[i] = tail;
+                    executed = true;
+                    continue;
+                }
+                for (; head != tail; head++)
+                {
+                    ShmCommand cmd = ring.cmds[head % ADAFRUIT_SHM_RING_DEPTH];
+                    if (!execute(cmd))
+                        ring.failures.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (heads[i] != head)
+                {
+                    heads[i] = head;
+                    executed = true;
+                }
+            }
+            if (executed)
+            {
+                // publish the state after the commands before their completion, so synced clients see it
+                seg->sleeping = 0;
+                moving = updateStatus();
+                for (int i = 0; i < ADAFRUIT_SHM_MAX_CLIENTS; i++)
+                {
+                    ShmRing &ring = seg->rings[i];
+                    if (ring.head.load(std::memory_order_relaxed) == heads[i])
+                        continue;
+                    ring.head.store(heads[i]);
+                    if (ring.waiters.load())
+                        shmWake(ring.head);
+                }
+                continue;
+            }
+            if (quit) // stop() rang the doorbell before the sample
+                break;
+            shmWait(seg->doorbell, bell, moving ? ADAFRUIT_SHM_STATUS_PERIOD_MS : -1);
+            seg->sleeping = 0;
+            if (moving)
+                moving = updateStatus();
+        }
+        return true;
+    }
+
+    void ShieldServer::stop()
+    {
+        int err = errno;
+        quit = true;
+        ShmSegment *seg = this->seg;
+        if (seg != nullptr)
+        {
+            seg->doorbell.fetch_add(1);
+            shmWake(seg->doorbell);
+        }
+        errno = err;
+    }
+
+    bool ShieldServer::execute(const ShmCommand &cmd)
+    {
+        MotorShield *shield = (*stack)[cmd.shield];
+        if (shield == NULL)
+        {
+            dbprintlf("Shield %u out of range [0-%u]", cmd.shield, stack->size() - 1);
+            return false;
+        }
+        if (cmd.op == SHM_DC || cmd.op == SHM_DCRAMP)
+        {
+            if (cmd.motor < 1 || cmd.motor > 4)
+            {
+                dbprintlf("Motor number %u out of range [1-4]", cmd.motor);
+                return false;
+            }
+            DCMotor *motor = shield->getMotor(cmd.motor);
+            if (motor == NULL)
+                return false;
+            if (cmd.op == SHM_DCRAMP)
+                return motor->rampTo(cmd.value < -4095 ? -4095 : cmd.value > 4095 ? 4095 : cmd.value, cmd.arg);
+            if (cmd.dir < FORWARD || cmd.dir > RELEASE || cmd.value < 0 || cmd.value > 4095)
+            {
+                dbprintlf("Invalid DC motor command: direction %u, speed %" PRId64, cmd.dir, cmd.value);
+                return false;
+            }
+            motor->run((MotorDir)cmd.dir);
+            motor->setSpeedFine(cmd.value);
+            return true;
+        }
+        if (cmd.motor < 1 || cmd.motor > 2)
+        {
+            dbprintlf("Motor number %u out of range [1-2]", cmd.motor);
+            return false;
+        }
+        StepperMotor *&mot = steppers[cmd.shield][cmd.motor - 1];
+        if (cmd.op == SHM_ATTACH)
+        {
+            if (mot == nullptr && cmd.value > 0 && cmd.value <= UINT16_MAX)
+                mot = shield->getStepper(cmd.value, cmd.motor, (MicroSteps)cmd.arg);
+            return mot != nullptr;
+        }
+        if (mot == nullptr)
+        {
+            dbprintlf("Stepper motor %u of shield %u not attached", cmd.motor, cmd.shield);
+            return false;
+        }
+        return executeStepper(mot, cmd);
+    }
+
+    bool ShieldServer::executeStepper(StepperMotor *mot, const ShmCommand &cmd)
+    {
+        bool move = cmd.op == SHM_STEP || cmd.op == SHM_GOTO;
+        if (move && ((cmd.dir != FORWARD && cmd.dir != BACKWARD && cmd.op == SHM_STEP) || cmd.style < SINGLE || cmd.style > MICROSTEP))
+        {
+            dbprintlf("Invalid move: direction %u, style %u", cmd.dir, cmd.style);
+            return false;
+        }
+        // the server must not block on the queue of a motor, other clients wait behind it
+        if (move && pending(mot) >= ADAFRUIT_STEPPER_QUEUE_DEPTH)
+        {
+            dbprintlf("Stepping queue full.");
+            return false;
+        }
+        try
+        {
+            switch (cmd.op)
+            {
+            case SHM_SPEED:
+                return mot->setSpeed(cmd.fvalue);
+            case SHM_STEP:
+                if (cmd.value < 0 || cmd.value > UINT32_MAX || !mot->enqueue(cmd.value, (MotorDir)cmd.dir, (MotorStyle)cmd.style))
+                    return false;
+                mot->flush();
+                return true;
+            case SHM_GOTO:
+                return mot->goTo(cmd.value, (MotorStyle)cmd.style, false);
+            case SHM_STOP:
+                mot->stopMotor();
+                return true;
+            case SHM_RELEASE:
+                mot->release();
+                return true;
+            case SHM_SETPOS:
+                return mot->setPosition(cmd.value);
+            default:
+                dbprintlf("Unknown command %u", cmd.op);
+                return false;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            dbprintlf("%s", e.what());
+            return false;
+        }
+    }
+
+    uint32_t ShieldServer::pending(StepperMotor *mot)
+    {
+        std::lock_guard<std::mutex> lock(mot->queue_lock);
+        return mot->qstaged - mot->completed;
+    }
+
+    bool ShieldServer::updateStatus()
+    {
+        ShieldStatus status[ADAFRUIT_STACK_MAX_SHIELDS];
+        bool moving = false;
+        memset(status, 0x0, sizeof(status));
+        for (uint8_t i = 0; i < stack->size(); i++)
+        {
+            MotorShield *shield = (*stack)[i];
+            status[i].addr = shield->_addr;
+            shield->getErrorCounts(status[i].errors);
+            for (int p = 0; p < 2; p++)
+            {
+                StepperMotor *mot = steppers[i][p];
+                StepperStatus &st = status[i].steppers[p];
+                if (mot == nullptr)
+                    continue;
+                st.attached = true;
+                st.position = mot->getPosition();
+                st.pending = pending(mot);
+                st.overruns = mot->getOverruns();
+                st.moving = mot->isMoving() || st.pending > 0;
+                moving = moving || st.moving;
+            }
+        }
+        // seqlock: readers retry while the sequence is odd or changed under them
+        uint32_t seq = seg->status_seq.load(std::memory_order_relaxed);
+        seg->status_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(seg->status, status, sizeof(status));
+        seg->status_seq.store(seq + 2);
+        if (seg->status_waiters.load())
+            shmWake(seg->status_seq);
+        return moving;
+    }
+}
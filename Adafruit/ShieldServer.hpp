@@ -0,0 +1,84 @@
+/**
+ * @file ShieldServer.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Server sharing a stack of Adafruit Motor Shield V2 boards with other processes through shared memory, run by motorshieldd.
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _ShieldServer_hpp_
+#define _ShieldServer_hpp_
+
+#include "ShieldShm.hpp"
+#include <sys/types.h>
+
+namespace Adafruit
+{
+    /**
+     * @brief Executes the commands of {@link Adafruit::ShieldClient} processes on the shields of a {@link Adafruit::ShieldStack}.
+     * Each client submits commands through its own lock-free ring in a shared memory segment and reads the state of the motors
+     * from a status page in the same segment, so that commands and status reads do not need a system call. The server sleeps
+     * on a futex while there is nothing to do, and is the only process that opens the I2C bus.
+     *
+     */
+    class ShieldServer
+    {
+    public:
+        /**
+         * @brief Create a server for the shields of a stack.
+         *
+         * @param stack Shield stack, initialized using {@link Adafruit::ShieldStack::begin}. Has to outlive the server.
+         */
+        ShieldServer(ShieldStack &stack);
+
+        /**
+         * @brief Stop the server, and remove the shared memory segment.
+         *
+         */
+        ~ShieldServer();
+
+        /**
+         * @brief Create the shared memory segment. A segment left behind by a server that no longer runs is replaced.
+         *
+         * @param name Name of the segment, see shm_open(3). {@link ADAFRUIT_SHM_NAME} by default.
+         * @param mode Permissions of the segment, read and write access is needed to connect. 0660 by default.
+         * @return bool true on success, false if another server uses the name or the segment could not be created.
+         */
+        bool open(const char *name = ADAFRUIT_SHM_NAME, mode_t mode = 0660);
+
+        /**
+         * @brief Remove the shared memory segment, connected clients fail their commands from now on.
+         *
+         */
+        void close();
+
+        /**
+         * @brief Execute client commands until {@link Adafruit::ShieldServer::stop} is called.
+         *
+         * @return bool false if the segment is not open, true otherwise.
+         */
+        bool run();
+
+        /**
+         * @brief Make {@link Adafruit::ShieldServer::run} return. Async-signal-safe.
+         *
+         */
+        void stop();
+
+    private:
+        ShieldStack *stack;
+        ShmSegment *seg;
+        char name[64];
+        std::atomic<bool> quit;
+        StepperMotor *steppers[ADAFRUIT_STACK_MAX_SHIELDS][2]; // attached by clients
+        bool execute(const ShmCommand &cmd);
+        bool executeStepper(StepperMotor *mot, const ShmCommand &cmd);
+        uint32_t pending(StepperMotor *mot);
+        bool updateStatus(); // returns true if a stepper is moving
+    };
+};
+
+#endif
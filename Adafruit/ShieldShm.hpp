@@ -0,0 +1,173 @@
+/**
+ * @file ShieldShm.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Shared memory layout used by motorshieldd ({@link Adafruit::ShieldServer}) and its clients ({@link Adafruit::ShieldClient}).
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _ShieldShm_hpp_
+#define _ShieldShm_hpp_
+
+#include "ShieldStack.hpp"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Adafruit
+{
+#if !defined(ADAFRUIT_SHM_NAME)
+/**
+ * @brief Default name of the shared memory segment of motorshieldd, see shm_open(3).
+ *
+ */
+#define ADAFRUIT_SHM_NAME "/motorshieldd"
+#endif
+
+#if !defined(ADAFRUIT_SHM_MAX_CLIENTS)
+/**
+ * @brief Maximum number of processes connected to motorshieldd at the same time, each has its own command ring.
+ *
+ */
+#define ADAFRUIT_SHM_MAX_CLIENTS 16
+#endif
+
+#if !defined(ADAFRUIT_SHM_RING_DEPTH)
+/**
+ * @brief Number of commands a client can submit to motorshieldd before they are executed. Must be a power of 2.
+ *
+ */
+#define ADAFRUIT_SHM_RING_DEPTH 64
+#endif
+
+#if !defined(ADAFRUIT_SHM_STATUS_PERIOD_MS)
+/**
+ * @brief Update period of the status page of motorshieldd while a stepper motor is moving, in milliseconds.
+ * The status is also updated after every batch of commands.
+ *
+ */
+#define ADAFRUIT_SHM_STATUS_PERIOD_MS 10
+#endif
+
+#if !defined(ADAFRUIT_SHM_TIMEOUT_MS)
+/**
+ * @brief Time a client waits for space in its command ring before a command fails, in milliseconds.
+ *
+ */
+#define ADAFRUIT_SHM_TIMEOUT_MS 1000
+#endif
+
+/**
+ * @brief Version of the shared memory layout, clients only connect to a daemon with the same version.
+ *
+ */
+#define ADAFRUIT_SHM_VERSION 1
+
+    /**
+     * @brief State of a stepper motor published by motorshieldd.
+     *
+     */
+    struct StepperStatus
+    {
+        int64_t position;  ///< Position in microsteps, see {@link Adafruit::StepperMotor::getPosition}
+        uint32_t pending;  ///< Moves queued or in progress
+        uint32_t overruns; ///< See {@link Adafruit::StepperMotor::getOverruns}
+        bool attached;     ///< The motor was created by a client
+        bool moving;       ///< The motor is stepping, or moves are queued
+    };
+
+    /**
+     * @brief State of a shield published by motorshieldd.
+     *
+     */
+    struct ShieldStatus
+    {
+        uint8_t addr;                  ///< I2C address of the shield
+        StepperStatus steppers[2];     ///< Stepper motors on port 1 and 2
+        I2CErrorCounts errors;         ///< I2C error counts of the shield
+    };
+
+#ifndef _DOXYGEN_
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "Shared memory rings need address-free atomics");
+    static_assert((ADAFRUIT_SHM_RING_DEPTH & (ADAFRUIT_SHM_RING_DEPTH - 1)) == 0, "ADAFRUIT_SHM_RING_DEPTH must be a power of 2");
+
+#define ADAFRUIT_SHM_MAGIC 0x4d534641 // "AFSM"
+
+    typedef enum : uint8_t
+    {
+        SHM_ATTACH = 1,  // getStepper, value: steps per revolution, arg: microsteps
+        SHM_SPEED = 2,   // setSpeed, fvalue: RPM
+        SHM_STEP = 3,    // step, value: steps
+        SHM_GOTO = 4,    // goTo, value: position
+        SHM_STOP = 5,    // stopMotor
+        SHM_RELEASE = 6, // release
+        SHM_SETPOS = 7,  // setPosition, value: position
+        SHM_DC = 8,      // DC motor run + setSpeedFine, value: PWM
+        SHM_DCRAMP = 9,  // DC motor rampTo, value: signed PWM, arg: duration in ms
+    } ShmOp;
+
+    struct ShmCommand
+    {
+        uint8_t op;     // ShmOp
+        uint8_t shield; // index in the stack
+        uint8_t motor;  // stepper port 1-2, DC motor 1-4
+        uint8_t dir;    // MotorDir
+        uint8_t style;  // MotorStyle
+        uint8_t reserved[3];
+        uint32_t arg;
+        int64_t value;
+        double fvalue;
+    };
+
+    // command ring of one client: the client writes the commands and tail, the daemon head and failures
+    struct ShmRing
+    {
+        std::atomic<int32_t> owner; // pid of the client, 0 if free
+        std::atomic<uint32_t> tail;
+        alignas(64) std::atomic<uint32_t> head;     // commands executed, futex word
+        std::atomic<uint32_t> waiters;              // clients waiting on head
+        std::atomic<uint32_t> failures;             // failed commands
+        alignas(64) ShmCommand cmds[ADAFRUIT_SHM_RING_DEPTH];
+    };
+
+    struct ShmSegment
+    {
+        std::atomic<uint32_t> magic; // written last by the daemon
+        uint16_t version;
+        uint8_t nshields;
+        uint8_t reserved;
+        uint32_t size;
+        int32_t pid; // daemon
+        std::atomic<uint32_t> quit;
+        alignas(64) std::atomic<uint32_t> doorbell; // incremented by clients after submitting, futex word
+        std::atomic<uint32_t> sleeping;             // the daemon waits on the doorbell
+        alignas(64) std::atomic<uint32_t> status_seq; // seqlock of the status, odd while it is written, futex word
+        std::atomic<uint32_t> status_waiters;
+        ShieldStatus status[ADAFRUIT_STACK_MAX_SHIELDS];
+        ShmRing rings[ADAFRUIT_SHM_MAX_CLIENTS];
+    };
+
+    // wait on a process-shared futex while it holds val, timeout_ms < 0 waits forever, returns false on timeout
+    static inline bool shmWait(std::atomic<uint32_t> &word, uint32_t val, int64_t timeout_ms)
+    {
+        struct timespec ts = {(time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000L};
+        if (syscall(SYS_futex, (uint32_t *)&word, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0) < 0)
+            return errno != ETIMEDOUT;
+        return true;
+    }
+
+    // wake all waiters of a process-shared futex, async-signal-safe
+    static inline void shmWake(std::atomic<uint32_t> &word)
+    {
+        syscall(SYS_futex, (uint32_t *)&word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    }
+#endif // _DOXYGEN_
+};
+
+#endif
@@ -0,0 +1,151 @@
+/*!
+ * @file ShieldStack.cpp
+ *
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ *
+ * @brief This is the implementation file for the controller of a stack of Adafruit Motor Shield V2 boards.
+ *
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * BSD license, all text here must be included in any redistribution.
+ *
+ */
+
+#include "ShieldStack.hpp"
+#include "meb_print.h"
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <exception>
+
+namespace Adafruit
+{
+    ShieldStack::Batch::Batch(ShieldStack &stack)
+    {
+        bus = stack.busmgr;
+        bus->lock();
+    }
+
+    ShieldStack::Batch::~Batch()
+    {
+        bus->unlock();
+    }
+
+    ShieldStack::ShieldStack(int bus, bool register_sighandler)
+    {
+        _bus = bus;
+        this->register_sighandler = register_sighandler;
+        nshields = 0;
+        for (int i = 0; i < ADAFRUIT_STACK_MAX_SHIELDS; i++)
+            shields[i] = nullptr;
+        busmgr = MotorShieldBus::get(bus);
+        if (busmgr == nullptr)
+            throw std::runtime_error("Too many I2C buses in use, could not use bus " + std::to_string(bus));
+    }
+
+    ShieldStack::~ShieldStack()
+    {
+        for (int i = nshields - 1; i >= 0; i--)
+            delete shields[i];
+        MotorShieldBus::put(busmgr);
+    }
+
+    MotorShield *_Catchable ShieldStack::addShield(uint8_t addr)
+    {
+        if (nshields >= ADAFRUIT_STACK_MAX_SHIELDS)
+        {
+            bprintlf("Shield stack full, can not add shield at 0x%02x", addr);
+            return NULL;
+        }
+        if (getShield(addr) != NULL)
+        {
+            bprintlf("Shield at 0x%02x already in the stack", addr);
+            return NULL;
+        }
+        // the library signal handler only needs to be registered once
+        MotorShield *shield = new MotorShield(addr, _bus, register_sighandler && nshields == 0);
+        shields[nshields++] = shield;
+        return shield;
+    }
+
+    bool _Catchable ShieldStack::begin(uint16_t freq, bool warm_start)
+    {
+        // in parallel, the shields share the bus while their oscillators start up
+        std::thread threads[ADAFRUIT_STACK_MAX_SHIELDS];
+        bool status[ADAFRUIT_STACK_MAX_SHIELDS];
+        std::exception_ptr errors[ADAFRUIT_STACK_MAX_SHIELDS];
+        auto init = [this, freq, warm_start, &status, &errors](int i) {
+            try
+            {
+                status[i] = shields[i]->begin(freq, warm_start);
+            }
+            catch (...)
+            {
+                status[i] = false;
+                errors[i] = std::current_exception();
+            }
+        };
+        bool serial = false;
+        for (int i = 0; i < nshields; i++)
+        {
+            if (!serial)
+            {
+                try
+                {
+                    threads[i] = std::thread(init, i);
+                    continue;
+                }
+                catch (const std::exception &e)
+                {
+                    // e.g. std::system_error (EAGAIN): the shields without a thread are initialized one after the other
+                    dbprintlf("Could not start initialization thread: %s", e.what());
+                    serial = true;
+                }
+            }
+            init(i);
+        }
+        bool ret = true;
+        for (int i = 0; i < nshields; i++)
+        {
+            if (threads[i].joinable())
+                threads[i].join();
+            ret &= status[i];
+        }
+        for (int i = 0; i < nshields; i++)
+            if (errors[i])
+                std::rethrow_exception(errors[i]);
+        return ret;
+    }
+
+    bool ShieldStack::setRealtime(int priority, int cpu, bool lock_memory)
+    {
+        bool status = true;
+        for (int i = 0; i < nshields; i++)
+            status &= shields[i]->setRealtime(priority, cpu, lock_memory && i == 0);
+        return status;
+    }
+
+    MotorShield *ShieldStack::getShield(uint8_t addr) const
+    {
+        for (int i = 0; i < nshields; i++)
+        {
+            if (shields[i]->getAddress() == addr)
+                return shields[i];
+        }
+        return NULL;
+    }
+
+    MotorShield *ShieldStack::operator[](uint8_t idx) const
+    {
+        if (idx >= nshields)
+            return NULL;
+        return shields[idx];
+    }
+
+    uint8_t ShieldStack::size() const
+    {
+        return nshields;
+    }
+}
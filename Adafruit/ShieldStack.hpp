@@ -0,0 +1,142 @@
+/**
+ * @file ShieldStack.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Controller for a stack of Adafruit Motor Shield V2 boards sharing an I2C bus.
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _ShieldStack_hpp_
+#define _ShieldStack_hpp_
+
+#include "MotorShield.hpp"
+
+namespace Adafruit
+{
+#if !defined(ADAFRUIT_STACK_MAX_SHIELDS)
+/**
+ * @brief Maximum number of shields in a {@link Adafruit::ShieldStack}. The PCA9685 address
+ * jumpers of the motor shield select addresses 0x60 through 0x7F.
+ *
+ */
+#define ADAFRUIT_STACK_MAX_SHIELDS 32
+#endif
+
+    /**
+     * @brief Object to create and control a stack of motor shields on one I2C bus.
+     * All shields of the stack share the {@link Adafruit::MotorShieldBus} for the bus, which grants
+     * I2C transactions to the shields in first-come, first-served order.
+     *
+     */
+    class ShieldStack
+    {
+    public:
+        /**
+         * @brief Holds the I2C bus of a stack for the lifetime of the object, so that updates to several
+         * shields made by the current thread go out back to back without transactions of other threads in between.
+         * Keep the scope of the object short, all other users of the bus wait while it exists.
+         *
+         */
+        class Batch
+        {
+        public:
+            /**
+             * @brief Take the bus of the stack.
+             *
+             * @param stack Shield stack.
+             */
+            Batch(ShieldStack &stack);
+
+            /**
+             * @brief Release the bus of the stack.
+             *
+             */
+            ~Batch();
+
+        private:
+            MotorShieldBus *bus;
+        };
+
+        /**
+         * @brief Create an empty shield stack on an I2C bus. Throws runtime error if motor shields
+         * are already in use on {@link ADAFRUIT_MAX_I2C_BUSES} other buses.
+         *
+         * @param bus Optional, default: 1
+         * @param register_sighandler Optional, registers the signal handlers of {@link Adafruit::MotorShield}
+         * when the first shield is added.
+         */
+        _Catchable ShieldStack(int bus = 1, bool register_sighandler = true);
+
+        /**
+         * @brief Release all shields of the stack and the I2C bus.
+         *
+         */
+        ~ShieldStack();
+
+        /**
+         * @brief Add a shield at an I2C address to the stack. Throws runtime error if the
+         * {@link Adafruit::MotorShield} object could not be created.
+         *
+         * @param addr I2C address of the shield.
+         * @return MotorShield* NULL if the stack is full or a shield with the address exists, valid pointer on success.
+         */
+        MotorShield *_Catchable addShield(uint8_t addr);
+
+        /**
+         * @brief Initialize all shields of the stack in parallel, see {@link Adafruit::MotorShield::begin}. If a thread can not
+         * be started, the remaining shields are initialized one after the other on the calling thread.
+         * Throws the first runtime error thrown by a shield, after all shields have been initialized.
+         *
+         * @param freq The PWM frequency for the drivers, by default 1600 Hz.
+         * @param warm_start Optional, skip the initialization of drivers that are already configured, default false.
+         * @return bool true if all shields were initialized, false otherwise.
+         */
+        bool _Catchable begin(uint16_t freq = 1600, bool warm_start = false);
+
+        /**
+         * @brief Set the real-time policy of the stepping and I2C bus threads of all shields of the stack,
+         * see {@link Adafruit::MotorShield::setRealtime}.
+         *
+         * @param priority SCHED_FIFO priority (1-99), 0 to return to the default time-sharing policy.
+         * @param cpu Optional, CPU to pin the threads to, -1 (default) leaves the CPU affinity unchanged.
+         * @param lock_memory Optional, lock the memory of the process, default true.
+         * @return bool true if the settings were applied to all shields, false otherwise.
+         */
+        bool setRealtime(int priority, int cpu = -1, bool lock_memory = true);
+
+        /**
+         * @brief Get the shield at an I2C address.
+         *
+         * @param addr I2C address of the shield.
+         * @return MotorShield* NULL if no shield with the address is in the stack.
+         */
+        MotorShield *getShield(uint8_t addr) const;
+
+        /**
+         * @brief Get a shield by its position in the stack, in order of addition.
+         *
+         * @param idx Index of the shield.
+         * @return MotorShield* NULL if out of range.
+         */
+        MotorShield *operator[](uint8_t idx) const;
+
+        /**
+         * @brief Get the number of shields in the stack.
+         *
+         * @return uint8_t Number of shields.
+         */
+        uint8_t size() const;
+
+    private:
+        int _bus;
+        bool register_sighandler;
+        MotorShieldBus *busmgr;
+        MotorShield *shields[ADAFRUIT_STACK_MAX_SHIELDS];
+        uint8_t nshields;
+    };
+};
+
+#endif
@@ -0,0 +1,566 @@
+/*!
+ * @file TrajectoryPlayer.cpp
+ *
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ *
+ * @brief This is the implementation file for the player of binary motion profiles of a stack of Adafruit Motor Shield V2 boards.
+ *
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * BSD license, all text here must be included in any redistribution.
+ *
+ */
+
+#include "TrajectoryPlayer.hpp"
+#include "meb_print.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#ifndef _DOXYGEN_
+static inline uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+// read exactly len bytes unless the end of the file is reached, returns the number of bytes read or -1 on error
+static ssize_t readFull(int fd, int quitfd, uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        if (quitfd >= 0)
+        {
+            struct pollfd pfd[2] = {{fd, POLLIN, 0}, {quitfd, POLLIN, 0}};
+            if (poll(pfd, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (pfd[1].revents)
+                break; // stop requested, return what was read
+        }
+        ssize_t ret = read(fd, buf + done, len - done);
+        if (ret < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    return done;
+}
+#endif // _DOXYGEN_
+
+namespace Adafruit
+{
+    TrajectoryPlayer::TrajectoryPlayer(ShieldStack &stack)
+    {
+        this->stack = &stack;
+        fd = -1;
+        memset(&header, 0x0, sizeof(header));
+        ticklen = 0;
+        map = nullptr;
+        maplen = 0;
+        buffers[0] = buffers[1] = nullptr;
+        buflen = 0;
+        fill[0] = fill[1] = 0;
+        eof = consumed = false;
+        quitfd = -1;
+        cur = 0;
+        pos = 0;
+        left = 0;
+        playing = started = quit = completed = false;
+        ticks = 0;
+        overruns = underruns = 0;
+    }
+
+    TrajectoryPlayer::~TrajectoryPlayer()
+    {
+        close();
+    }
+
+    bool TrajectoryPlayer::open(const char *path)
+    {
+        int fd = strcmp(path, "-") ? ::open(path, O_RDONLY | O_CLOEXEC) : dup(STDIN_FILENO);
+        if (fd < 0)
+        {
+            bprintlf("Error %d opening trajectory %s: %s", errno, path, strerror(errno));
+            return false;
+        }
+        return open(fd);
+    }
+
+    bool TrajectoryPlayer::open(int fd)
+    {
+        close();
+        this->fd = fd;
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            bprintlf("Error %d checking trajectory file: %s", errno, strerror(errno));
+            close();
+            return false;
+        }
+        if (S_ISREG(st.st_mode))
+        {
+            if ((size_t)st.st_size < sizeof(header))
+            {
+                bprintlf("Trajectory file too short for the header (%zu bytes)", (size_t)st.st_size);
+                close();
+                return false;
+            }
+            void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                bprintlf("Error %d mapping trajectory file: %s", errno, strerror(errno));
+                close();
+                return false;
+            }
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            map = (const uint8_t *)addr;
+            maplen = st.st_size;
+            memcpy(&header, map, sizeof(header));
+        }
+        else if (readFull(fd, -1, (uint8_t *)&header, sizeof(header)) != sizeof(header))
+        {
+            bprintlf("Could not read the trajectory header");
+            close();
+            return false;
+        }
+        if (!readHeader())
+        {
+            close();
+            return false;
+        }
+        if (map != nullptr)
+        {
+            uint64_t avail = (maplen - sizeof(header)) / ticklen;
+            if ((maplen - sizeof(header)) % ticklen)
+                bprintlf("Trajectory file ends with a partial tick, which is ignored");
+            if (header.ticks > avail)
+            {
+                bprintlf("Trajectory file holds %" PRIu64 " of %" PRIu64 " ticks", avail, header.ticks);
+                close();
+                return false;
+            }
+            return true;
+        }
+        quitfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (quitfd < 0)
+        {
+            bprintlf("Error %d creating eventfd: %s", errno, strerror(errno));
+            close();
+            return false;
+        }
+        // the buffers hold whole ticks, so a tick never spans two of them
+        buflen = ADAFRUIT_TRAJECTORY_BUFFER / ticklen * ticklen;
+        if (buflen == 0)
+            buflen = ticklen;
+        buffers[0] = new uint8_t[buflen];
+        buffers[1] = new uint8_t[buflen];
+        return true;
+    }
+
+    bool TrajectoryPlayer::readHeader()
+    {
+        if (memcmp(header.magic, "AFTR", 4))
+        {
+            bprintlf("Not a trajectory file");
+            return false;
+        }
+        if (header.version != 1)
+        {
+            bprintlf("Trajectory format version %u not supported", header.version);
+            return false;
+        }
+        if (header.shields == 0 || header.shields > stack->size())
+        {
+            bprintlf("Trajectory for %u shields, the stack has %u", header.shields, stack->size());
+            return false;
+        }
+        if (header.style < SINGLE || header.style > MICROSTEP)
+        {
+            bprintlf("Stepping style %u unknown", header.style);
+            return false;
+        }
+        if (header.tick_us == 0)
+        {
+            bprintlf("Tick duration has to be positive.");
+            return false;
+        }
+        ticklen = header.shields * ADAFRUIT_TRAJECTORY_ENTRY_SIZE;
+        return true;
+    }
+
+    void TrajectoryPlayer::close()
+    {
+        stop();
+        if (map != nullptr)
+            munmap((void *)map, maplen);
+        map = nullptr;
+        maplen = 0;
+        delete[] buffers[0];
+        delete[] buffers[1];
+        buffers[0] = buffers[1] = nullptr;
+        if (quitfd >= 0)
+            ::close(quitfd);
+        quitfd = -1;
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        memset(&header, 0x0, sizeof(header));
+        eof = consumed = false;
+    }
+
+    bool TrajectoryPlayer::play(bool blocking)
+    {
+        join(); // threads of the previous playback
+        if (fd < 0)
+        {
+            bprintlf("No trajectory open, please invoke open().");
+            return false;
+        }
+        if (map == nullptr && consumed)
+        {
+            bprintlf("Streamed trajectory was already played.");
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            playing = true;
+            started = quit = completed = false;
+        }
+        ticks = 0;
+        cur = 0;
+        pos = map != nullptr ? sizeof(header) : 0;
+        left = header.ticks ? header.ticks : UINT64_MAX;
+        if (map == nullptr)
+        {
+            consumed = true;
+            fill[0] = fill[1] = 0;
+            eof = false;
+            uint64_t val;
+            if (read(quitfd, &val, sizeof(val)) < 0) // clear the stop of a previous playback
+                dbprintlf("No stop pending: %s", strerror(errno));
+            reader = std::thread(readerFn, this);
+        }
+        player = std::thread(playerFn, this);
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            cond.wait(lk, [this]() { return started || !playing; });
+            if (!started)
+            {
+                lk.unlock();
+                join();
+                return false;
+            }
+        }
+        return blocking ? wait() : true;
+    }
+
+    void TrajectoryPlayer::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            quit = true;
+        }
+        cond.notify_all();
+        if (quitfd >= 0)
+        {
+            uint64_t one = 1;
+            if (write(quitfd, &one, sizeof(one)) < 0)
+                dbprintlf("Error %d waking up the trajectory reader: %s", errno, strerror(errno));
+        }
+        join();
+    }
+
+    bool TrajectoryPlayer::wait()
+    {
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            cond.wait(lk, [this]() { return !playing; });
+        }
+        join();
+        std::lock_guard<std::mutex> lk(lock);
+        return completed;
+    }
+
+    bool TrajectoryPlayer::isPlaying() const
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        return playing;
+    }
+
+    const TrajectoryHeader &TrajectoryPlayer::getHeader() const
+    {
+        return header;
+    }
+
+    uint64_t TrajectoryPlayer::getTicks() const
+    {
+        return ticks;
+    }
+
+    uint32_t TrajectoryPlayer::getOverruns() const
+    {
+        return overruns;
+    }
+
+    uint32_t TrajectoryPlayer::getUnderruns() const
+    {
+        return underruns;
+    }
+
+    void TrajectoryPlayer::join()
+    {
+        std::lock_guard<std::mutex> lk(join_lock);
+        if (player.joinable())
+            player.join();
+        if (reader.joinable())
+            reader.join();
+    }
+
+    void TrajectoryPlayer::readerFn(TrajectoryPlayer *tp)
+    {
+        // fills the buffers in turn, each one once the player is done with it
+        int b = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lk(tp->lock);
+                tp->cond.wait(lk, [tp, b]() { return tp->quit || tp->fill[b] == 0; });
+                if (tp->quit)
+                    break;
+            }
+            ssize_t len = readFull(tp->fd, tp->quitfd, tp->buffers[b], tp->buflen);
+            bool end = len < (ssize_t)tp->buflen;
+            std::unique_lock<std::mutex> lk(tp->lock);
+            if (tp->quit)
+                break;
+            if (len < 0)
+            {
+                bprintlf("Error %d reading trajectory: %s", errno, strerror(errno));
+                tp->quit = true; // the playback fails
+                len = 0;
+            }
+            else if (len % tp->ticklen)
+            {
+                bprintlf("Trajectory ends with a partial tick, which is ignored");
+                len -= len % tp->ticklen;
+            }
+            tp->fill[b] = len;
+            tp->eof = end;
+            lk.unlock();
+            tp->cond.notify_all();
+            if (end)
+                break;
+            b ^= 1;
+        }
+    }
+
+    const uint8_t *TrajectoryPlayer::nextTick()
+    {
+        if (left == 0)
+            return nullptr;
+        if (map != nullptr)
+        {
+            if (pos + ticklen > maplen)
+                return nullptr;
+            const uint8_t *tick = map + pos;
+            pos += ticklen;
+            left--;
+            return tick;
+        }
+        std::unique_lock<std::mutex> lk(lock);
+        if (fill[cur] && pos == fill[cur])
+        {
+            // hand the buffer back to the reader, continue with the other one
+            fill[cur] = 0;
+            cur ^= 1;
+            pos = 0;
+            cond.notify_all();
+        }
+        if (fill[cur] == 0 && !eof && !quit)
+        {
+            underruns++;
+            cond.wait(lk, [this]() { return fill[cur] || eof || quit; });
+        }
+        if (fill[cur] == 0 || quit)
+            return nullptr;
+        const uint8_t *tick = buffers[cur] + pos;
+        pos += ticklen;
+        left--;
+        return tick;
+    }
+
+    void TrajectoryPlayer::playerFn(TrajectoryPlayer *tp)
+    {
+        bool ok = tp->run();
+        {
+            std::lock_guard<std::mutex> lk(tp->lock);
+            tp->completed = ok;
+            tp->playing = false;
+            tp->quit = true; // ends the reader
+        }
+        tp->cond.notify_all();
+        if (tp->quitfd >= 0)
+        {
+            uint64_t one = 1;
+            if (write(tp->quitfd, &one, sizeof(one)) < 0)
+                dbprintlf("Error %d waking up the trajectory reader: %s", errno, strerror(errno));
+        }
+    }
+
+    bool TrajectoryPlayer::run()
+    {
+        uint8_t nshields = header.shields;
+        MotorShield *shields[ADAFRUIT_STACK_MAX_SHIELDS];
+        // the steppers are driven by this thread, their workers wait until the playback ends
+        std::unique_lock<std::mutex> claims[2 * ADAFRUIT_STACK_MAX_SHIELDS];
+        uint32_t gens[2 * ADAFRUIT_STACK_MAX_SHIELDS]; // stop generations of the claimed steppers
+        for (uint8_t s = 0; s < nshields; s++)
+        {
+            shields[s] = (*stack)[s];
+            for (int i = 0; i < 2; i++)
+            {
+                StepperMotor &mot = shields[s]->steppers[i];
+                if (!mot.initd)
+                    continue;
+                claims[2 * s + i] = std::unique_lock<std::mutex>(mot.cs, std::try_to_lock);
+                if (!claims[2 * s + i].owns_lock())
+                {
+                    bprintlf("Stepper %d of shield 0x%02x is moving, can not play the trajectory", i + 1, shields[s]->_addr);
+                    return false;
+                }
+            }
+        }
+        int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timerfd < 0)
+        {
+            bprintlf("Error %d creating trajectory timer: %s", errno, strerror(errno));
+            return false;
+        }
+        for (uint8_t s = 0; s < nshields; s++)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (claims[2 * s + i].owns_lock())
+                {
+                    gens[2 * s + i] = shields[s]->steppers[i].stop_gen.load(); // stopMotor() from now on ends the playback
+                    shields[s]->steppers[i].moving = true;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            started = true;
+        }
+        cond.notify_all();
+
+        const MotorStyle style = (MotorStyle)header.style;
+        const uint64_t nsper = header.tick_us * 1000LLU;
+        const uint32_t epoch = MotorShield::estopEpoch();
+        uint64_t deadline = monotonicNs();
+        bool ok = true, done = false;
+        while (ok)
+        {
+            const uint8_t *tick = nextTick();
+            if (tick == nullptr)
+            {
+                // end of the trajectory, unless a streamed one was stopped or could not be read
+                std::lock_guard<std::mutex> lk(lock);
+                done = map != nullptr || left == 0 || !quit;
+                break;
+            }
+            // absolute schedule, as the stepping threads
+            deadline += nsper;
+            struct itimerspec its;
+            memset(&its, 0x0, sizeof(its));
+            its.it_value.tv_sec = deadline / 1000000000LLU;
+            its.it_value.tv_nsec = deadline % 1000000000LLU;
+            if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+            {
+                bprintlf("Error %d arming trajectory timer: %s", errno, strerror(errno));
+                ok = false;
+                break;
+            }
+            uint64_t expirations;
+            while (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            {
+                if (errno != EINTR)
+                {
+                    bprintlf("Error %d reading trajectory timer: %s", errno, strerror(errno));
+                    ok = false;
+                    break;
+                }
+            }
+            uint64_t now = monotonicNs();
+            if (now > deadline && now - deadline > ADAFRUIT_STEPPER_MAX_CATCHUP * nsper)
+            {
+                deadline = now;
+                overruns++;
+            }
+            bool stopped;
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                stopped = quit;
+            }
+            if (!ok || stopped)
+                break;
+            {
+                ShieldStack::Batch batch(*stack); // all shields of the tick back to back
+                // checked holding the bus, so no tick follows an emergency stop turning the outputs off
+                stopped = MotorShield::estopEpoch() != epoch;
+                for (uint8_t s = 0; s < nshields; s++)
+                    for (int i = 0; i < 2; i++)
+                        stopped |= claims[2 * s + i].owns_lock() && shields[s]->steppers[i].stop_gen.load() != gens[2 * s + i];
+                if (stopped)
+                    break;
+                for (uint8_t s = 0; s < nshields && ok; s++)
+                {
+                    const uint8_t *entry = tick + s * ADAFRUIT_TRAJECTORY_ENTRY_SIZE;
+                    int8_t steps[2] = {(int8_t)entry[0], (int8_t)entry[1]};
+                    int16_t pwm[4];
+                    uint8_t dc_mask = 0;
+                    for (int i = 0; i < 4; i++)
+                    {
+                        pwm[i] = (int16_t)(entry[2 + 2 * i] | (entry[3 + 2 * i] << 8));
+                        if (pwm[i] != ADAFRUIT_TRAJECTORY_DC_KEEP)
+                            dc_mask |= 1 << i;
+                    }
+                    ok = shields[s]->applyTick(steps, style, pwm, dc_mask);
+                }
+            }
+            ticks++;
+        }
+        ::close(timerfd);
+        for (uint8_t s = 0; s < nshields; s++)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (!claims[2 * s + i].owns_lock())
+                    continue;
+                shields[s]->steppers[i].moving = false;
+                claims[2 * s + i].unlock();
+                shields[s]->steppers[i].armHold(); // the hold current is reduced after the playback, too
+            }
+        }
+        return ok && done;
+    }
+};
@@ -0,0 +1,199 @@
+/**
+ * @file TrajectoryPlayer.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Player for binary motion profiles of a stack of Adafruit Motor Shield V2 boards.
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _TrajectoryPlayer_hpp_
+#define _TrajectoryPlayer_hpp_
+
+#include "ShieldStack.hpp"
+
+namespace Adafruit
+{
+#if !defined(ADAFRUIT_TRAJECTORY_BUFFER)
+/**
+ * @brief Size of each of the two buffers used to stream a trajectory that can not be memory-mapped (pipes, sockets), in bytes.
+ *
+ */
+#define ADAFRUIT_TRAJECTORY_BUFFER 65536
+#endif
+
+/**
+ * @brief Size of the entries of one shield in a tick of a trajectory, in bytes: 2 x int8_t steps, 4 x int16_t PWM.
+ *
+ */
+#define ADAFRUIT_TRAJECTORY_ENTRY_SIZE 10
+
+/**
+ * @brief PWM value of a DC motor in a trajectory that leaves the motor unchanged.
+ *
+ */
+#define ADAFRUIT_TRAJECTORY_DC_KEEP INT16_MIN
+
+    /**
+     * @brief Header of a trajectory file, followed by the ticks. A tick holds one entry of {@link ADAFRUIT_TRAJECTORY_ENTRY_SIZE}
+     * bytes for each shield, in the order the shields were added to the stack:
+     *
+     * | Offset | Type          | Contents                                                                                   |
+     * |--------|---------------|--------------------------------------------------------------------------------------------|
+     * | 0      | int8_t[2]     | Steps of stepper 1 and 2: 1 (FORWARD), -1 (BACKWARD) or 0                                  |
+     * | 2      | int16_t[4]    | PWM of DC motor 1 to 4, -4095 to 4095, the sign selects the direction, 0 releases the motor, {@link ADAFRUIT_TRAJECTORY_DC_KEEP} leaves it unchanged |
+     *
+     * All fields are little-endian.
+     *
+     */
+    struct TrajectoryHeader
+    {
+        char magic[4];     ///< "AFTR"
+        uint16_t version;  ///< Format version, 1
+        uint8_t shields;   ///< Number of shields in each tick
+        uint8_t style;     ///< MotorStyle of the steps, MICROSTEP steps use the microsteps of the stepper
+        uint32_t tick_us;  ///< Duration of a tick, us
+        uint32_t reserved; ///< 0
+        uint64_t ticks;    ///< Number of ticks, 0 for all ticks up to the end of the file
+    };
+
+    /**
+     * @brief Plays a trajectory file on a {@link Adafruit::ShieldStack}, one tick at a time on an absolute schedule.
+     * Regular files are memory-mapped, other files (pipes, sockets) are read through two fixed buffers by a reader thread,
+     * so the memory use does not depend on the length of the trajectory. Each tick is written as one I2C transaction per shield.
+     *
+     * The steppers of the stack must not be moving when playback starts. Stepper commands issued during playback run after it.
+     * {@link Adafruit::StepperMotor::stopMotor}, {@link Adafruit::MotorShield::emergencyStop} and {@link Adafruit::TrajectoryPlayer::stop}
+     * end the playback. The player thread inherits the scheduling policy of the thread calling {@link Adafruit::TrajectoryPlayer::play}.
+     *
+     */
+    class TrajectoryPlayer
+    {
+    public:
+        /**
+         * @brief Create a player for the shields of a stack.
+         *
+         * @param stack Shield stack, has to outlive the player.
+         */
+        TrajectoryPlayer(ShieldStack &stack);
+
+        /**
+         * @brief Stop playback and close the trajectory.
+         *
+         */
+        ~TrajectoryPlayer();
+
+        /**
+         * @brief Open a trajectory file and check its header.
+         *
+         * @param path Path of the file, "-" for the standard input.
+         * @return bool true on success, false if the file could not be read, the header is invalid or the stack has too few shields.
+         */
+        bool open(const char *path);
+
+        /**
+         * @brief Open a trajectory from a file descriptor, which is closed by {@link Adafruit::TrajectoryPlayer::close}.
+         *
+         * @param fd File descriptor.
+         * @return bool true on success, false if the file could not be read, the header is invalid or the stack has too few shields.
+         */
+        bool open(int fd);
+
+        /**
+         * @brief Stop playback and close the trajectory.
+         *
+         */
+        void close();
+
+        /**
+         * @brief Play the trajectory from the beginning. A streamed trajectory can only be played once.
+         *
+         * @param blocking Wait until the playback ends, true by default.
+         * @return bool true if the playback started (and, if blocking, played all ticks), false otherwise.
+         */
+        bool play(bool blocking = true);
+
+        /**
+         * @brief Stop playback after the current tick, the motors keep the state of the last tick.
+         *
+         */
+        void stop();
+
+        /**
+         * @brief Wait until the playback ends.
+         *
+         * @return bool true if all ticks were played, false if the playback was stopped or failed.
+         */
+        bool wait();
+
+        /**
+         * @brief Check if the trajectory is being played.
+         *
+         * @return bool
+         */
+        bool isPlaying() const;
+
+        /**
+         * @brief Get the header of the open trajectory.
+         *
+         * @return const TrajectoryHeader&
+         */
+        const TrajectoryHeader &getHeader() const;
+
+        /**
+         * @brief Get the number of ticks played since the playback started.
+         *
+         * @return uint64_t
+         */
+        uint64_t getTicks() const;
+
+        /**
+         * @brief Get the number of times the player fell more than {@link ADAFRUIT_STEPPER_MAX_CATCHUP} ticks behind
+         * its schedule and restarted it from the current time.
+         *
+         * @return uint32_t
+         */
+        uint32_t getOverruns() const;
+
+        /**
+         * @brief Get the number of times a streamed trajectory was not read in time for the next tick.
+         *
+         * @return uint32_t
+         */
+        uint32_t getUnderruns() const;
+
+    private:
+        ShieldStack *stack;
+        int fd;
+        TrajectoryHeader header;
+        size_t ticklen;           // bytes per tick
+        const uint8_t *map;       // memory-mapped file, nullptr if streamed
+        size_t maplen;
+        uint8_t *buffers[2];      // streaming double buffer
+        size_t buflen;            // capacity of a buffer, whole ticks
+        size_t fill[2];           // bytes in a buffer, 0 if it is being filled
+        bool eof;                 // the reader reached the end of the stream
+        bool consumed;            // a streamed trajectory was played
+        int quitfd;               // eventfd, wakes up the reader
+        int cur;                  // buffer being played
+        size_t pos;               // offset of the next tick in the map or the buffer being played
+        uint64_t left;            // ticks left to play, UINT64_MAX up to the end of the file
+        std::thread reader, player;
+        std::mutex join_lock;     // serializes joining the threads
+        mutable std::mutex lock;  // protects the state below, and fill and eof
+        std::condition_variable cond;
+        bool playing, started, quit, completed;
+        std::atomic<uint64_t> ticks;
+        std::atomic<uint32_t> overruns, underruns;
+        static void readerFn(TrajectoryPlayer *tp);
+        static void playerFn(TrajectoryPlayer *tp);
+        bool readHeader();
+        const uint8_t *nextTick();
+        bool run();
+        void join();
+    };
+};
+
+#endif
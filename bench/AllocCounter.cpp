@@ -0,0 +1,114 @@
+/*!
+ * @file AllocCounter.cpp
+ *
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ *
+ * @brief This is the implementation file for the counting allocator used by the benchmarks.
+ *
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * BSD license, all text here must be included in any redistribution.
+ *
+ */
+
+#include "AllocCounter.hpp"
+#include <stdlib.h>
+#include <errno.h>
+#include <atomic>
+
+static std::atomic<bool> armed(false);
+static std::atomic<uint64_t> allocs(0);
+
+static inline void countAlloc()
+{
+    if (armed.load(std::memory_order_relaxed))
+        allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+// the executable's definitions take precedence over the C library's, and forward to its allocator
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t nmemb, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void *ptr);
+
+    void *malloc(size_t size)
+    {
+        countAlloc();
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t nmemb, size_t size)
+    {
+        countAlloc();
+        return __libc_calloc(nmemb, size);
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        countAlloc();
+        return __libc_realloc(ptr, size);
+    }
+
+    void *memalign(size_t alignment, size_t size)
+    {
+        countAlloc();
+        return __libc_memalign(alignment, size);
+    }
+
+    void *aligned_alloc(size_t alignment, size_t size)
+    {
+        countAlloc();
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void **memptr, size_t alignment, size_t size)
+    {
+        if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+            return EINVAL;
+        countAlloc();
+        void *ptr = __libc_memalign(alignment, size);
+        if (ptr == nullptr)
+            return ENOMEM;
+        *memptr = ptr;
+        return 0;
+    }
+
+    void free(void *ptr)
+    {
+        __libc_free(ptr);
+    }
+}
+#endif
+
+namespace AllocCounter
+{
+    bool available()
+    {
+#if defined(__GLIBC__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void arm()
+    {
+        allocs = 0;
+        armed = true;
+    }
+
+    void disarm()
+    {
+        armed = false;
+    }
+
+    uint64_t count()
+    {
+        return allocs;
+    }
+}
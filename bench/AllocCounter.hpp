@@ -0,0 +1,47 @@
+/**
+ * @file AllocCounter.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Counting allocator, to check that the motor control paths do not allocate after setup.
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _AllocCounter_hpp_
+#define _AllocCounter_hpp_
+
+#include <stdint.h>
+
+namespace AllocCounter
+{
+    /**
+     * @brief Check if allocations are counted: malloc and friends are interposed on glibc only.
+     *
+     * @return bool
+     */
+    bool available();
+
+    /**
+     * @brief Reset the count and start counting the allocations of all threads.
+     *
+     */
+    void arm();
+
+    /**
+     * @brief Stop counting allocations.
+     *
+     */
+    void disarm();
+
+    /**
+     * @brief Get the number of allocations (malloc, calloc, realloc, memalign and everything built on them, e.g. operator new)
+     * since the last {@link AllocCounter::arm}.
+     *
+     * @return uint64_t
+     */
+    uint64_t count();
+}
+
+#endif
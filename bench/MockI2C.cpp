@@ -0,0 +1,207 @@
+/*!
+ * @file MockI2C.cpp
+ *
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ *
+ * @brief This is the implementation file for the mock I2C backend used by the benchmarks.
+ *
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * BSD license, all text here must be included in any redistribution.
+ *
+ */
+
+#include "MockI2C.hpp"
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#define MOCK_MAX_DEVICES 64
+
+#define PCA9685_ALLLED_ON_L 0xFA
+
+#ifndef _DOXYGEN_
+struct MockDevice
+{
+    std::atomic<i2cbus *> dev;
+    int addr;
+    std::atomic<uint32_t> failures; // transactions left to fail
+    int err;
+    uint8_t regs[256];
+};
+#endif
+
+static MockDevice devices[MOCK_MAX_DEVICES];
+static std::mutex devices_lock;
+
+static std::atomic<uint64_t> transaction_ns(25000);
+static std::atomic<uint64_t> byte_ns(22500);
+
+static std::atomic<uint64_t> num_writes(0);
+static std::atomic<uint64_t> num_xfers(0);
+static std::atomic<uint64_t> num_bytes(0);
+
+static MockDevice *findDevice(i2cbus *dev)
+{
+    for (int i = 0; i < MOCK_MAX_DEVICES; i++)
+        if (devices[i].dev.load(std::memory_order_acquire) == dev)
+            return &devices[i];
+    return nullptr;
+}
+
+static bool injectFailure(MockDevice *d)
+{
+    uint32_t left = d->failures.load(std::memory_order_relaxed);
+    while (left && !d->failures.compare_exchange_weak(left, left - 1, std::memory_order_relaxed))
+        ;
+    if (!left)
+        return false;
+    errno = d->err;
+    return true;
+}
+
+static void busyWait(ssize_t bytes)
+{
+    uint64_t ns = transaction_ns.load(std::memory_order_relaxed) + byte_ns.load(std::memory_order_relaxed) * bytes;
+    if (ns == 0)
+        return;
+    auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+    while (std::chrono::steady_clock::now() < until)
+        ;
+}
+
+// register file with auto-increment, writes to the ALL_LED registers go to every channel
+static void writeRegs(MockDevice *d, const uint8_t *buf, ssize_t len)
+{
+    uint8_t reg = buf[0];
+    for (ssize_t i = 1; i < len; i++, reg++)
+    {
+        d->regs[reg] = buf[i];
+        if (reg >= PCA9685_ALLLED_ON_L && reg < PCA9685_ALLLED_ON_L + 4)
+            for (int ch = 0; ch < 16; ch++)
+                d->regs[0x6 + 4 * ch + reg - PCA9685_ALLLED_ON_L] = buf[i];
+    }
+}
+
+static int mockOpen(i2cbus *dev, int, int addr) // any bus number
+{
+    std::lock_guard<std::mutex> lock(devices_lock);
+    for (int i = 0; i < MOCK_MAX_DEVICES; i++)
+    {
+        if (devices[i].dev.load(std::memory_order_relaxed) == nullptr)
+        {
+            devices[i].addr = addr;
+            devices[i].failures = 0;
+            memset(devices[i].regs, 0, sizeof(devices[i].regs));
+            devices[i].dev.store(dev, std::memory_order_release);
+            return 1;
+        }
+    }
+    return -1;
+}
+
+static int mockWrite(i2cbus *dev, const void *buf, ssize_t len)
+{
+    MockDevice *d = findDevice(dev);
+    if (d == nullptr || len < 1)
+        return -1;
+    if (injectFailure(d))
+    {
+        busyWait(1); // address byte, not acknowledged
+        return -1;
+    }
+    busyWait(len);
+    writeRegs(d, (const uint8_t *)buf, len);
+    num_writes.fetch_add(1, std::memory_order_relaxed);
+    num_bytes.fetch_add(len, std::memory_order_relaxed);
+    return len;
+}
+
+static int mockXfer(i2cbus *dev, void *out, ssize_t outlen, void *in, ssize_t inlen, unsigned long)
+{
+    MockDevice *d = findDevice(dev);
+    if (d == nullptr || outlen < 1)
+        return -1;
+    if (injectFailure(d))
+    {
+        busyWait(1);
+        return -1;
+    }
+    busyWait(outlen + inlen);
+    const uint8_t *obuf = (const uint8_t *)out;
+    if (outlen > 1)
+        writeRegs(d, obuf, outlen);
+    uint8_t reg = obuf[0] + (outlen - 1);
+    for (ssize_t i = 0; i < inlen; i++, reg++)
+        ((uint8_t *)in)[i] = d->regs[reg];
+    num_xfers.fetch_add(1, std::memory_order_relaxed);
+    num_bytes.fetch_add(outlen + inlen, std::memory_order_relaxed);
+    return inlen;
+}
+
+static int mockClose(i2cbus *dev)
+{
+    std::lock_guard<std::mutex> lock(devices_lock);
+    MockDevice *d = findDevice(dev);
+    if (d == nullptr)
+        return -1;
+    d->dev.store(nullptr, std::memory_order_release);
+    return 1;
+}
+
+static const Adafruit::I2CBackend mock_backend = {mockOpen, mockWrite, mockXfer, mockClose};
+
+namespace MockI2C
+{
+    const Adafruit::I2CBackend *backend()
+    {
+        return &mock_backend;
+    }
+
+    void setLatency(uint64_t transaction, uint64_t byte)
+    {
+        transaction_ns = transaction;
+        byte_ns = byte;
+    }
+
+    void reset()
+    {
+        num_writes = 0;
+        num_xfers = 0;
+        num_bytes = 0;
+    }
+
+    Counters counters()
+    {
+        Counters c;
+        c.writes = num_writes.load(std::memory_order_relaxed);
+        c.xfers = num_xfers.load(std::memory_order_relaxed);
+        c.bytes = num_bytes.load(std::memory_order_relaxed);
+        return c;
+    }
+
+    void fail(int addr, int err, uint32_t count)
+    {
+        std::lock_guard<std::mutex> lock(devices_lock);
+        for (int i = 0; i < MOCK_MAX_DEVICES; i++)
+        {
+            if (devices[i].dev.load(std::memory_order_relaxed) != nullptr && devices[i].addr == addr)
+            {
+                devices[i].err = err;
+                devices[i].failures = count;
+            }
+        }
+    }
+
+    uint8_t reg(int addr, uint8_t reg)
+    {
+        std::lock_guard<std::mutex> lock(devices_lock);
+        for (int i = 0; i < MOCK_MAX_DEVICES; i++)
+            if (devices[i].dev.load(std::memory_order_relaxed) != nullptr && devices[i].addr == addr)
+                return devices[i].regs[reg];
+        return 0;
+    }
+}
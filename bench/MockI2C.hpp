@@ -0,0 +1,79 @@
+/**
+ * @file MockI2C.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Mock I2C backend emulating PCA9685 PWM drivers, for benchmarks without hardware.
+ * @version Refer to changelog.
+ * @date Refer to changelog.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _MockI2C_hpp_
+#define _MockI2C_hpp_
+
+#include <Adafruit/MotorShield.hpp>
+#include <stdint.h>
+
+namespace MockI2C
+{
+    /**
+     * @brief Transaction counters of the mock bus.
+     *
+     */
+    struct Counters
+    {
+        uint64_t writes; ///< Write transactions
+        uint64_t xfers;  ///< Write-then-read transactions
+        uint64_t bytes;  ///< Bytes transferred in either direction
+    };
+
+    /**
+     * @brief Get the backend to pass to {@link Adafruit::MotorShield::setI2CBackend}.
+     *
+     * @return const Adafruit::I2CBackend* Mock backend.
+     */
+    const Adafruit::I2CBackend *backend();
+
+    /**
+     * @brief Set the simulated latency of a transaction, which the mock busy waits for.
+     * The default approximates a 400 kHz bus.
+     *
+     * @param transaction_ns Fixed cost of a transaction (start, address, stop).
+     * @param byte_ns Cost of each byte transferred.
+     */
+    void setLatency(uint64_t transaction_ns, uint64_t byte_ns);
+
+    /**
+     * @brief Reset the counters.
+     *
+     */
+    void reset();
+
+    /**
+     * @brief Get the counters.
+     *
+     * @return Counters Transactions and bytes since the last reset.
+     */
+    Counters counters();
+
+    /**
+     * @brief Make the next transactions with a device fail, e.g. to emulate a browned-out shield.
+     *
+     * @param addr I2C address of the device.
+     * @param err errno of the failed transactions, e.g. EREMOTEIO for a NAK.
+     * @param count Number of transactions to fail, 0 to stop failing.
+     */
+    void fail(int addr, int err, uint32_t count);
+
+    /**
+     * @brief Read an emulated register of an open device.
+     *
+     * @param addr I2C address of the device.
+     * @param reg Register address.
+     * @return uint8_t Register value, 0 if no device is open at the address.
+     */
+    uint8_t reg(int addr, uint8_t reg);
+}
+
+#endif
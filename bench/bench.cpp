@@ -0,0 +1,322 @@
+#include <Adafruit/MotorShield.hpp>
+#include <Adafruit/ShieldStack.hpp>
+#include "MockI2C.hpp"
+#include "AllocCounter.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <chrono>
+
+#define BENCH_TICKS 1000
+
+uint64_t get_ts_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char *styleName(Adafruit::MotorStyle style)
+{
+    switch (style)
+    {
+    case Adafruit::MotorStyle::SINGLE:
+        return "SINGLE";
+    case Adafruit::MotorStyle::DOUBLE:
+        return "DOUBLE";
+    case Adafruit::MotorStyle::INTERLEAVE:
+        return "INTERLEAVE";
+    default:
+        return "MICROSTEP";
+    }
+}
+
+// step timer ticks per step() step, an INTERLEAVE step is one half step tick
+static uint32_t ticksPerStep(Adafruit::MotorStyle style, Adafruit::MicroSteps msteps)
+{
+    if (style == Adafruit::MotorStyle::MICROSTEP)
+        return msteps;
+    return 1;
+}
+
+static void benchStepRate(Adafruit::MotorShield &AFMS)
+{
+    const Adafruit::MotorStyle styles[] = {Adafruit::MotorStyle::SINGLE, Adafruit::MotorStyle::DOUBLE, Adafruit::MotorStyle::INTERLEAVE, Adafruit::MotorStyle::MICROSTEP};
+    const Adafruit::MicroSteps msteps[] = {Adafruit::MicroSteps::STEP8, Adafruit::MicroSteps::STEP16, Adafruit::MicroSteps::STEP64};
+    printf("Max step rate (%d ticks per run)\n", BENCH_TICKS);
+    printf("%-12s %-8s %12s %12s %12s\n", "style", "msteps", "ticks/s", "xfers/tick", "bytes/tick");
+    Adafruit::StepperMotor *motor = AFMS.getStepper(200, 1);
+    motor->setSpeed(3e5); // 1 us per step, the bus is the limit
+    for (auto ms : msteps)
+    {
+        motor->setStep(ms);
+        for (auto style : styles)
+        {
+            if (style != Adafruit::MotorStyle::MICROSTEP && ms != msteps[0])
+                continue; // full and half steps do not depend on the microstep setting
+            uint32_t tps = ticksPerStep(style, ms);
+            uint32_t steps = BENCH_TICKS / tps;
+            MockI2C::reset();
+            uint64_t start = get_ts_now();
+            motor->step(steps, Adafruit::MotorDir::FORWARD, style);
+            uint64_t elapsed = get_ts_now() - start;
+            MockI2C::Counters c = MockI2C::counters();
+            double ticks = steps * tps;
+            printf("%-12s %-8u %12.0f %12.2f %12.2f\n", styleName(style), style == Adafruit::MotorStyle::MICROSTEP ? (unsigned)ms : 0, ticks * 1e9 / elapsed, (c.writes + c.xfers) / ticks, c.bytes / ticks);
+        }
+    }
+    motor->release();
+    printf("\n");
+}
+
+static void benchSetup(Adafruit::MotorShield &AFMS)
+{
+    const int runs = 200;
+    Adafruit::StepperMotor *motor = AFMS.getStepper(200, 2);
+    motor->setSpeed(3e5);
+    uint64_t blocking = 0, issue = 0, total = 0;
+    for (int i = 0; i < runs; i++)
+    {
+        uint64_t start = get_ts_now();
+        motor->step(1, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::DOUBLE);
+        blocking += get_ts_now() - start;
+    }
+    for (int i = 0; i < runs; i++)
+    {
+        uint64_t start = get_ts_now();
+        motor->step(1, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::DOUBLE, false);
+        issue += get_ts_now() - start;
+        motor->waitIdle();
+        total += get_ts_now() - start;
+    }
+    motor->release();
+    printf("step(1) latency (%d runs)\n", runs);
+    printf("  blocking:     %10.1f us\n", blocking / 1e3 / runs);
+    printf("  non-blocking: %10.1f us to return, %.1f us to complete\n\n", issue / 1e3 / runs, total / 1e3 / runs);
+}
+
+static void benchContention()
+{
+    const int nshields = 4;
+    Adafruit::ShieldStack stack(1, false);
+    Adafruit::StepperMotor *motors[2 * nshields];
+    for (int i = 0; i < nshields; i++)
+        stack.addShield(0x60 + i);
+    stack.begin();
+    for (int i = 0; i < nshields; i++)
+    {
+        for (int p = 0; p < 2; p++)
+        {
+            motors[2 * i + p] = stack[i]->getStepper(200, p + 1);
+            motors[2 * i + p]->setSpeed(3e5);
+        }
+    }
+    printf("Contention (%d shields, %d steppers on one bus, %d ticks each)\n", nshields, 2 * nshields, BENCH_TICKS);
+    for (int n = 1; n <= 2 * nshields; n *= 2)
+    {
+        MockI2C::reset();
+        uint64_t start = get_ts_now();
+        for (int i = 0; i < n; i++)
+            motors[i]->step(BENCH_TICKS, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::DOUBLE, false);
+        for (int i = 0; i < n; i++)
+            motors[i]->waitIdle();
+        uint64_t elapsed = get_ts_now() - start;
+        MockI2C::Counters c = MockI2C::counters();
+        printf("  %d steppers: %10.0f ticks/s total, %10.0f ticks/s per stepper, %.2f xfers/tick\n", n, (double)n * BENCH_TICKS * 1e9 / elapsed, (double)BENCH_TICKS * 1e9 / elapsed, (double)(c.writes + c.xfers) / (n * BENCH_TICKS));
+    }
+    for (int i = 0; i < 2 * nshields; i++)
+        motors[i]->release();
+    printf("\n");
+}
+
+static void benchDC(Adafruit::MotorShield &AFMS)
+{
+    const int runs = 1000;
+    Adafruit::DCMotor *motor = AFMS.getMotor(1);
+    motor->run(Adafruit::MotorDir::FORWARD);
+    AFMS.sync();
+    MockI2C::reset();
+    uint64_t start = get_ts_now();
+    for (int i = 0; i < runs; i++)
+        motor->setSpeed(i & 0xff);
+    uint64_t issue = get_ts_now() - start;
+    AFMS.sync();
+    uint64_t total = get_ts_now() - start;
+    MockI2C::Counters c = MockI2C::counters();
+    printf("DC setSpeed (%d calls)\n", runs);
+    printf("  %.2f us per call to return, %.2f us per call until synced, %" PRIu64 " transactions\n\n", issue / 1e3 / runs, total / 1e3 / runs, c.writes + c.xfers);
+    motor->run(Adafruit::MotorDir::RELEASE);
+    AFMS.sync();
+}
+
+static void benchDCBatch(Adafruit::MotorShield &AFMS)
+{
+    const int runs = 500;
+    Adafruit::DCMotor *motors[4];
+    for (int i = 0; i < 4; i++)
+        motors[i] = AFMS.getMotor(i + 1);
+    AFMS.sync();
+    printf("Update of 4 DC motors, direction and speed (%d updates)\n", runs);
+    for (int batched = 0; batched < 2; batched++)
+    {
+        MockI2C::reset();
+        uint64_t start = get_ts_now();
+        for (int i = 0; i < runs; i++)
+        {
+            Adafruit::MotorDir dir = i & 0x1 ? Adafruit::MotorDir::BACKWARD : Adafruit::MotorDir::FORWARD;
+            uint16_t speed = 16 * (i & 0xff);
+            if (batched)
+            {
+                Adafruit::DCCommand cmds[4] = {{dir, speed}, {dir, speed}, {dir, speed}, {dir, speed}};
+                AFMS.applyDC(cmds);
+            }
+            else
+            {
+                for (int m = 0; m < 4; m++)
+                {
+                    motors[m]->run(dir);
+                    motors[m]->setSpeedFine(speed);
+                }
+                AFMS.sync();
+            }
+        }
+        uint64_t total = get_ts_now() - start;
+        MockI2C::Counters c = MockI2C::counters();
+        printf("  %-19s %8.2f us per update, %5.2f xfers/update, %6.2f bytes/update\n", batched ? "applyDC():" : "run() + setSpeed():",
+               total / 1e3 / runs, (double)(c.writes + c.xfers) / runs, (double)c.bytes / runs);
+    }
+    printf("\n");
+    for (int i = 0; i < 4; i++)
+        motors[i]->run(Adafruit::MotorDir::RELEASE);
+    AFMS.sync();
+}
+
+// changing the microstep setting keeps the position exactly, or fails; returns false if the position was lost
+static bool benchMicrostepRoundTrip(Adafruit::MotorShield &AFMS)
+{
+    printf("Microstep setting round trip\n");
+    Adafruit::StepperMotor *motor = AFMS.getStepper(200, 1);
+    motor->setSpeed(600);
+    motor->setStep(Adafruit::MicroSteps::STEP16);
+    motor->setPosition(0);
+    motor->goTo(7);
+    bool ok = !motor->setStep(Adafruit::MicroSteps::STEP8) && motor->getPosition() == 7;
+    printf("  STEP16 -> STEP8 at 7:     %s, position %" PRId64 "\n", ok ? "refused" : "changed", motor->getPosition());
+    motor->goTo(8);
+    static const Adafruit::MicroSteps settings[] = {Adafruit::MicroSteps::STEP8, Adafruit::MicroSteps::STEP512, Adafruit::MicroSteps::STEP16};
+    for (Adafruit::MicroSteps ms : settings)
+        ok = motor->setStep(ms) && ok;
+    ok = ok && motor->getPosition() == 8;
+    printf("  STEP16 -> STEP8 -> STEP512 -> STEP16 at 8: position %" PRId64 "\n", motor->getPosition());
+    printf("  %s\n\n", ok ? "OK" : "FAIL");
+    return ok;
+}
+
+static void countCallback(Adafruit::StepperMotor *, void *data)
+{
+    (*(int *)data)++;
+}
+
+// after setup, stepping, DC control and stopping must not allocate; returns false if they did
+static bool benchAllocations(Adafruit::MotorShield &AFMS)
+{
+    printf("Heap allocations after setup\n");
+    if (!AllocCounter::available())
+    {
+        printf("  not counted on this C library\n\n");
+        return true;
+    }
+    Adafruit::StepperMotor *steppers[2] = {AFMS.getStepper(200, 1), AFMS.getStepper(200, 2)};
+    Adafruit::DCMotor *motor = AFMS.getMotor(1);
+    for (int i = 0; i < 2; i++)
+    {
+        steppers[i]->setSpeed(3e5);
+        steppers[i]->setHoldCurrent(50, 1);
+    }
+    int callbacks = 0;
+    bool ok = true;
+    uint64_t count;
+
+    AllocCounter::arm();
+    for (int i = 0; i < 2; i++)
+    {
+        steppers[i]->step(10, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::DOUBLE);
+        steppers[i]->step(10, Adafruit::MotorDir::BACKWARD, Adafruit::MotorStyle::MICROSTEP, true, countCallback, &callbacks);
+        steppers[i]->setStep(Adafruit::MicroSteps::STEP32);
+        steppers[i]->stepAsync(10, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::MICROSTEP).wait();
+        Adafruit::MoveHandle move;
+        if (steppers[i]->stepAsync(move, 10, Adafruit::MotorDir::BACKWARD, Adafruit::MotorStyle::MICROSTEP))
+            move.wait();
+        steppers[i]->setStep(Adafruit::MicroSteps::STEP16);
+        steppers[i]->enqueue(10, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::INTERLEAVE);
+        steppers[i]->enqueue(10, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::SINGLE, countCallback, &callbacks);
+        steppers[i]->flush();
+        steppers[i]->setSpeed(2e5);
+        steppers[i]->waitIdle();
+    }
+    AFMS.stepCoordinated(20, Adafruit::MotorDir::FORWARD, 10, Adafruit::MotorDir::BACKWARD, Adafruit::MotorStyle::DOUBLE);
+    usleep(5000); // hold current reduction
+    steppers[0]->step(1000, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::SINGLE, false);
+    steppers[0]->stopMotor();
+    count = AllocCounter::count();
+    printf("  stepping:  %" PRIu64 " allocations\n", count);
+    ok = ok && count == 0;
+
+    AllocCounter::arm();
+    motor->run(Adafruit::MotorDir::FORWARD);
+    motor->setSpeed(128);
+    motor->setSpeedFine(2048);
+    Adafruit::DCCommand cmds[4] = {{Adafruit::MotorDir::BACKWARD, 1024}};
+    AFMS.applyDC(cmds, 0x1);
+    motor->rampTo(4095, 2 * ADAFRUIT_DC_RAMP_PERIOD_MS);
+    while (motor->isRamping())
+        usleep(1000);
+    motor->fullOff();
+    AFMS.sync();
+    count = AllocCounter::count();
+    printf("  DC motors: %" PRIu64 " allocations\n", count);
+    ok = ok && count == 0;
+
+    AllocCounter::arm();
+    motor->run(Adafruit::MotorDir::FORWARD);
+    for (int i = 0; i < 2; i++)
+        steppers[i]->step(1000, Adafruit::MotorDir::FORWARD, Adafruit::MotorStyle::SINGLE, false);
+    Adafruit::MotorShield::emergencyStop();
+    AFMS.allOff();
+    for (int i = 0; i < 2; i++)
+        steppers[i]->release();
+    motor->run(Adafruit::MotorDir::RELEASE);
+    AFMS.sync();
+    count = AllocCounter::count();
+    AllocCounter::disarm();
+    printf("  stopping:  %" PRIu64 " allocations\n", count);
+    ok = ok && count == 0;
+
+    printf("  %s\n\n", ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t transaction_ns = 25000, byte_ns = 22500; // ~400 kHz bus
+    if (argc > 1)
+        transaction_ns = strtoull(argv[1], NULL, 10);
+    if (argc > 2)
+        byte_ns = strtoull(argv[2], NULL, 10);
+    printf("Mock bus: %" PRIu64 " ns per transaction, %" PRIu64 " ns per byte\n\n", transaction_ns, byte_ns);
+    MockI2C::setLatency(transaction_ns, byte_ns);
+    Adafruit::MotorShield::setI2CBackend(MockI2C::backend());
+    bool ok;
+    {
+        Adafruit::MotorShield AFMS(0x60, 1, false);
+        AFMS.begin();
+        benchStepRate(AFMS);
+        benchSetup(AFMS);
+        benchDC(AFMS);
+        benchDCBatch(AFMS);
+        ok = benchMicrostepRoundTrip(AFMS);
+        ok = benchAllocations(AFMS) && ok;
+    }
+    benchContention();
+    Adafruit::MotorShield::setI2CBackend(NULL);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+#include <Adafruit/ShieldServer.hpp>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+static Adafruit::ShieldServer *server = nullptr;
+
+// runs after the library handler stopped the motors on SIGINT
+static void sighandler(int)
+{
+    if (server != nullptr)
+        server->stop();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b bus] [-n name] [-m mode] [-f freq] [-r priority] [-c cpu] addr [addr ...]\n", prog);
+    fprintf(stderr, "  -b bus       I2C bus of the shields, default 1\n");
+    fprintf(stderr, "  -n name      shared memory name, default %s\n", ADAFRUIT_SHM_NAME);
+    fprintf(stderr, "  -m mode      permissions of the shared memory (octal), default 0660\n");
+    fprintf(stderr, "  -f freq      PWM frequency, default 1600 Hz\n");
+    fprintf(stderr, "  -r priority  SCHED_FIFO priority of the stepping and bus threads, default 0 (off)\n");
+    fprintf(stderr, "  -c cpu       CPU to pin the real-time threads to, default -1 (any)\n");
+    fprintf(stderr, "  addr         I2C addresses of the shields, e.g. 0x60\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int bus = 1, priority = 0, cpu = -1, opt;
+    const char *name = ADAFRUIT_SHM_NAME;
+    mode_t mode = 0660;
+    uint16_t freq = 1600;
+    while ((opt = getopt(argc, argv, "b:n:m:f:r:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            bus = atoi(optarg);
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        case 'm':
+            mode = strtoul(optarg, NULL, 8);
+            break;
+        case 'f':
+            freq = atoi(optarg);
+            break;
+        case 'r':
+            priority = atoi(optarg);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    // installed first, so the handler of the library stops the motors and then calls this one
+    signal(SIGINT, sighandler);
+    try
+    {
+        Adafruit::ShieldStack stack(bus, true);
+        for (int i = optind; i < argc; i++)
+        {
+            uint8_t addr = strtoul(argv[i], NULL, 0);
+            if (stack.addShield(addr) == NULL)
+            {
+                fprintf(stderr, "Could not add shield 0x%02x\n", addr);
+                return 1;
+            }
+        }
+        if (!stack.begin(freq))
+        {
+            fprintf(stderr, "Could not initialize the shields\n");
+            return 1;
+        }
+        signal(SIGTERM, Adafruit::MotorShield::sighandler);
+        if (priority > 0 && !stack.setRealtime(priority, cpu))
+            fprintf(stderr, "Could not set the real-time policy, continuing without\n");
+        Adafruit::ShieldServer srv(stack);
+        if (!srv.open(name, mode))
+            return 1;
+        server = &srv;
+        printf("motorshieldd: %u shields on bus %d, serving %s\n", stack.size(), bus, name);
+        srv.run();
+        server = nullptr;
+        printf("motorshieldd: exiting\n");
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}